@@ -23,6 +23,8 @@
 #include <linux/random.h>
 #include <linux/version.h>
 #include <linux/blkdev.h>
+#include <linux/vmalloc.h>
+#include <linux/crc32c.h>
 #include "pxd_compat.h"
 #include "pxd_fastpath.h"
 #include "pxd_core.h"
@@ -40,6 +42,23 @@
 
 #define FUSE_MAX_REQUEST_IDS (2 * FUSE_DEFAULT_MAX_BACKGROUND)
 
+/* fuse_req.inflight of a queued request, ids start at FUSE_MAX_REQUEST_IDS */
+#define FUSE_REQ_PENDING 1
+/* fuse_req.inflight while a reader copies the request to user space */
+#define FUSE_REQ_READING 2
+/* fuse_req.inflight while user space I/O on the io ring uses its pages */
+#define FUSE_REQ_HELD 3
+
+/* Most user requests a read completes before looking for requests */
+#define FUSE_USER_QUEUE_BATCH 64
+
+/* lockless lookups may find a request which is being freed */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,12,0)
+#define FUSE_REQ_CACHE_FLAGS SLAB_TYPESAFE_BY_RCU
+#else
+#define FUSE_REQ_CACHE_FLAGS SLAB_DESTROY_BY_RCU
+#endif
+
 static struct kmem_cache *fuse_req_cachep;
 
 static struct fuse_conn *fuse_get_conn(struct file *file)
@@ -129,29 +148,100 @@ static unsigned len_args(unsigned numargs, struct fuse_arg *args)
 	return nbytes;
 }
 
+static inline struct fuse_req **fuse_request_slot(struct fuse_conn *fc,
+	u64 uid)
+{
+	u32 index = uid & (FUSE_MAX_REQUEST_IDS - 1);
+
+	return &fc->request_map[index >> fc->map_shift]
+		[index & ((1U << fc->map_shift) - 1)];
+}
+
+static struct fuse_id_mag *fuse_id_pop(struct fuse_conn *fc,
+	atomic64_t *stack)
+{
+	u64 old = atomic64_read(stack);
+	u64 new, prev;
+	u32 top;
+
+	for (;;) {
+		top = (u32)old;
+		if (top == FUSE_ID_MAG_NONE)
+			return NULL;
+		new = (((old >> 32) + 1) << 32) |
+			READ_ONCE(fc->id_mags[top]->next);
+		prev = atomic64_cmpxchg(stack, old, new);
+		if (prev == old)
+			return fc->id_mags[top];
+		old = prev;
+	}
+}
+
+static void fuse_id_push(atomic64_t *stack, struct fuse_id_mag *mag)
+{
+	u64 old = atomic64_read(stack);
+	u64 new, prev;
+
+	for (;;) {
+		WRITE_ONCE(mag->next, (u32)old);
+		new = (((old >> 32) + 1) << 32) | mag->index;
+		prev = atomic64_cmpxchg(stack, old, new);
+		if (prev == old)
+			return;
+		old = prev;
+	}
+}
+
+/*
+ * Take a magazine from the depot of @node, else from the other nodes. Every
+ * cpu holds two magazines and there are spare ones besides, so an empty
+ * magazine is always in some depot. Magazines are sized so that the ids
+ * all cpus hold leave more than the requests in flight can take, a full
+ * magazine is in some depot too. Retries only follow racing cpus moving
+ * magazines between depots.
+ */
+static struct fuse_id_mag *fuse_id_depot_get(struct fuse_conn *fc, int node,
+	bool full)
+{
+	struct fuse_id_depot *depot;
+	struct fuse_id_mag *mag;
+	int i;
+
+	for (;;) {
+		for (i = 0; i < nr_node_ids; ++i) {
+			depot = &fc->id_depots[(node + i) % nr_node_ids];
+			mag = fuse_id_pop(fc,
+				full ? &depot->full : &depot->empty);
+			if (mag)
+				return mag;
+		}
+		cpu_relax();
+	}
+}
+
 static u64 fuse_get_unique(struct fuse_conn *fc)
 {
 	struct fuse_per_cpu_ids *my_ids;
+	struct fuse_id_mag *mag;
 	u64 uid;
-	int num_alloc;
+	int node;
 
 	int cpu = get_cpu();
 
 	my_ids = per_cpu_ptr(fc->per_cpu_ids, cpu);
 
-	if (unlikely(my_ids->num_free_ids == 0)) {
-		spin_lock(&fc->lock);
-		BUG_ON(fc->num_free_ids == 0);
-		num_alloc = min(fc->num_free_ids, (u32)FUSE_MAX_PER_CPU_IDS / 2);
-		memcpy(my_ids->free_ids, &fc->free_ids[fc->num_free_ids - num_alloc],
-			num_alloc * sizeof(u64));
-		fc->num_free_ids -= num_alloc;
-		spin_unlock(&fc->lock);
-
-		my_ids->num_free_ids = num_alloc;
+	if (unlikely(my_ids->loaded->count == 0)) {
+		if (my_ids->prev->count) {
+			swap(my_ids->loaded, my_ids->prev);
+		} else {
+			node = cpu_to_node(cpu);
+			fuse_id_push(&fc->id_depots[node].empty, my_ids->loaded);
+			my_ids->loaded = fuse_id_depot_get(fc, node, true);
+		}
 	}
 
-	uid = my_ids->free_ids[--my_ids->num_free_ids];
+	mag = my_ids->loaded;
+	uid = mag->ids[--mag->count];
 
 	put_cpu();
 
@@ -167,42 +257,677 @@ static u64 fuse_get_unique(struct fuse_conn *fc)
 static void fuse_put_unique(struct fuse_conn *fc, u64 uid)
 {
 	struct fuse_per_cpu_ids *my_ids;
-	int num_free;
-	int cpu = get_cpu();
+	struct fuse_id_mag *mag;
+	int cpu, node;
+
+	/* request_end() cleared the slot, the id may be handed out again */
+	cpu = get_cpu();
 
 	my_ids = per_cpu_ptr(fc->per_cpu_ids, cpu);
 
-	if (unlikely(my_ids->num_free_ids == FUSE_MAX_PER_CPU_IDS)) {
-		num_free = FUSE_MAX_PER_CPU_IDS / 2;
-		spin_lock(&fc->lock);
-		BUG_ON(fc->num_free_ids + num_free > FUSE_MAX_REQUEST_IDS);
-		memcpy(&fc->free_ids[fc->num_free_ids],
-			&my_ids->free_ids[my_ids->num_free_ids - num_free],
-			num_free * sizeof(u64));
-		fc->num_free_ids += num_free;
-		spin_unlock(&fc->lock);
+	if (unlikely(my_ids->loaded->count == fc->id_mag_size)) {
+		/* only full magazines go on the full stack of a depot */
+		if (my_ids->prev->count < fc->id_mag_size) {
+			swap(my_ids->loaded, my_ids->prev);
+		} else {
+			node = cpu_to_node(cpu);
+			fuse_id_push(&fc->id_depots[node].full, my_ids->prev);
+			my_ids->prev = my_ids->loaded;
+			my_ids->loaded = fuse_id_depot_get(fc, node, false);
+		}
+	}
 
-		my_ids->num_free_ids -= num_free;
+	mag = my_ids->loaded;
+	mag->ids[mag->count++] = uid;
+
+	put_cpu();
+}
+
+static struct fuse_pqueue *fuse_req_queue(struct fuse_conn *fc,
+		struct fuse_req *req)
+{
+	return &fc->queues[req->qid];
+}
+
+/*
+ * Claim a request in state @state for finishing it. Replies, aborts and
+ * restarts race for requests user space has without a lock, only the one
+ * which swaps out the id finishes the request. The id carries the
+ * generation of the request map slot, a stale lookup of a slot which got
+ * reused cannot claim the new request. Queued requests are claimed with
+ * the lock of their queue held.
+ *
+ * Lockless lookups dereference a request which may be finished and freed
+ * under them, they hold rcu_read_lock() from the slot read to the claim.
+ * The request cache is SLAB_TYPESAFE_BY_RCU, the memory stays a request
+ * and a claim of a reused one fails on the id. Requests embedded in blk-mq
+ * requests live as long as their tag set.
+ */
+static bool fuse_req_claim(struct fuse_req *req, u64 state)
+{
+	return atomic64_cmpxchg(&req->inflight, state, 0) == state;
+}
+
+/* User space gets the request, replies may claim it from now on */
+static void fuse_req_sent(struct fuse_req *req)
+{
+	atomic64_set(&req->inflight, req->in.h.unique);
+}
+
+/* Wait for a reader or io ring I/O to hand the request back */
+static void fuse_req_wait_idle(struct fuse_req *req)
+{
+	u64 state;
+
+	for (;;) {
+		state = atomic64_read(&req->inflight);
+		if (state != FUSE_REQ_READING && state != FUSE_REQ_HELD)
+			break;
+		cpu_relax();
 	}
+}
 
-	my_ids->free_ids[my_ids->num_free_ids++] = uid;
+/*
+ * Keep request @unique user space has from being finished while io ring
+ * I/O uses its pages. Returns NULL if user space does not have it.
+ */
+struct fuse_req *fuse_request_hold(struct fuse_conn *fc, u64 unique)
+{
+	struct fuse_req *req;
 
-	fc->request_map[uid & (FUSE_MAX_REQUEST_IDS - 1)] = NULL;
+	rcu_read_lock();
+	req = request_find(fc, unique);
+	if (req && atomic64_cmpxchg(&req->inflight, unique,
+				    FUSE_REQ_HELD) != unique)
+		req = NULL;
+	rcu_read_unlock();
 
-	put_cpu();
+	return req;
+}
+
+/* Hand a held request back to user space once the I/O is done */
+void fuse_request_unhold(struct fuse_req *req)
+{
+	/* orders the I/O on the pages before anyone finishes the request */
+	smp_mb__before_atomic();
+	atomic64_set(&req->inflight, req->in.h.unique);
+}
+
+/* Flushes, FUA and metadata writes and requests other than I/O go first */
+static u32 fuse_req_prio(struct fuse_req *req)
+{
+	switch (req->in.h.opcode) {
+	case PXD_READ:
+	case PXD_WRITE:
+	case PXD_WRITE_SAME:
+	case PXD_DISCARD:
+		if (req->pxd_rdwr_in.flags & (PXD_FLAGS_SYNC | PXD_FLAGS_META))
+			return FUSE_PRIO_URGENT;
+		return FUSE_PRIO_BULK;
+	default:
+		return FUSE_PRIO_URGENT;
+	}
+}
+
+/*
+ * Find the flow of the device of @req, allocating it on first use. Devices
+ * share the fallback flow while memory is short. Called with the lock of
+ * the queue held.
+ */
+static struct fuse_flow *fuse_req_flow(struct fuse_pqueue *pq,
+		struct fuse_req *req)
+{
+	u32 minor = req->pxd_rdwr_in.dev_minor;
+	struct hlist_head *bucket;
+	struct fuse_flow *flow;
+
+	bucket = &pq->flows[hash_32(minor, FUSE_PQUEUE_FLOW_BITS)];
+	hlist_for_each_entry(flow, bucket, hash) {
+		if (flow->minor == minor)
+			return flow;
+	}
+
+	/* submitters add to the queue of their cpu, memory is local */
+	flow = kmalloc(sizeof(*flow), GFP_ATOMIC | __GFP_NOWARN);
+	if (unlikely(!flow))
+		return &pq->fallback;
+	flow->minor = minor;
+	INIT_LIST_HEAD(&flow->pending);
+	INIT_LIST_HEAD(&flow->active);
+	flow->deficit = 0;
+	hlist_add_head(&flow->hash, bucket);
+	return flow;
+}
+
+static void fuse_pqueue_free_flows(struct fuse_pqueue *pq)
+{
+	struct fuse_flow *flow;
+	struct hlist_node *next;
+	u32 i;
+
+	for (i = 0; i < FUSE_PQUEUE_FLOWS; ++i) {
+		hlist_for_each_entry_safe(flow, next, &pq->flows[i], hash)
+			kfree(flow);
+	}
+}
+
+/* Bytes a bulk request is charged against the deficit of its flow */
+static u32 fuse_req_cost(struct fuse_req *req)
+{
+	if (req->in.h.opcode != PXD_READ && req->in.h.opcode != PXD_WRITE)
+		return PXD_LBS;
+	return max_t(u32, req->pxd_rdwr_in.size, PXD_LBS);
+}
+
+/*
+ * Add a request to the urgent list or the list of its flow, at the tail
+ * or at the head for requests going back to the queue. A flow which had
+ * nothing pending joins the active flows with no deficit. Called with the
+ * lock of the queue held.
+ */
+static void fuse_pqueue_add(struct fuse_pqueue *pq, struct fuse_req *req,
+		bool head)
+{
+	struct fuse_flow *flow;
+
+	if (req->prio == FUSE_PRIO_URGENT) {
+		if (head)
+			list_add(&req->list, &pq->urgent);
+		else
+			list_add_tail(&req->list, &pq->urgent);
+		return;
+	}
+
+	flow = fuse_req_flow(pq, req);
+	req->flow = flow;
+	if (list_empty(&flow->pending)) {
+		flow->deficit = 0;
+		if (head)
+			list_add(&flow->active, &pq->active);
+		else
+			list_add_tail(&flow->active, &pq->active);
+	}
+	if (head)
+		list_add(&req->list, &flow->pending);
+	else
+		list_add_tail(&req->list, &flow->pending);
+}
+
+/*
+ * Move newly submitted requests of @pq to the pending lists, oldest first.
+ * Called with the lock of the queue held.
+ */
+static void fuse_pqueue_flush(struct fuse_pqueue *pq)
+{
+	struct llist_node *node = llist_del_all(&pq->submit);
+	struct fuse_req *req, *next;
+	LIST_HEAD(tmp);
+
+	/* the submit list is newest first, adding at the head reverses it */
+	while (node) {
+		req = llist_entry(node, struct fuse_req, llnode);
+		node = node->next;
+		list_add(&req->list, &tmp);
+	}
+	list_for_each_entry_safe(req, next, &tmp, list)
+		fuse_pqueue_add(pq, req, false);
+}
+
+/*
+ * Move all pending requests of @pq to the head of @head, for aborting
+ * them. Called with the lock of the queue held.
+ */
+static void fuse_pqueue_drain(struct fuse_pqueue *pq, struct list_head *head)
+{
+	struct fuse_flow *flow, *next;
+
+	fuse_pqueue_flush(pq);
+	list_for_each_entry_safe(flow, next, &pq->active, active) {
+		list_splice_init(&flow->pending, head);
+		list_del_init(&flow->active);
+	}
+	list_splice_init(&pq->urgent, head);
+}
+
+static bool fuse_pqueue_empty(struct fuse_pqueue *pq)
+{
+	return list_empty(&pq->urgent) && list_empty(&pq->active) &&
+		llist_empty(&pq->submit);
+}
+
+/*
+ * Deficit round robin over the active flows. The flow at the head of the
+ * active list dispatches while its deficit covers the cost of its next
+ * request, else it is given another quantum and goes to the tail. Devices
+ * with deep queues thereby get the same share of reader bandwidth as the
+ * devices with few requests sharing the queue.
+ */
+static struct fuse_req *fuse_pqueue_next_bulk(struct fuse_pqueue *pq)
+{
+	struct fuse_flow *flow;
+	struct fuse_req *req;
+
+	while (1) {
+		flow = list_first_entry(&pq->active, struct fuse_flow, active);
+		req = list_first_entry(&flow->pending, struct fuse_req, list);
+		if (fuse_req_cost(req) <= flow->deficit)
+			return req;
+		flow->deficit += FUSE_FLOW_QUANTUM;
+		list_move_tail(&flow->active, &pq->active);
+	}
+}
+
+extern uint32_t pxd_prio_ratio;
+
+/*
+ * Pick the request to dispatch next. Urgent requests go first, but after
+ * pxd_prio_ratio of them in a row a waiting bulk request gets its turn.
+ * Called with the lock of the queue held, returns NULL if nothing is
+ * pending.
+ */
+static struct fuse_req *fuse_pqueue_next(struct fuse_pqueue *pq)
+{
+	if (list_empty(&pq->active))
+		return list_first_entry_or_null(&pq->urgent, struct fuse_req,
+			list);
+	if (list_empty(&pq->urgent) ||
+	    pq->urgent_run >= max_t(u32, READ_ONCE(pxd_prio_ratio), 1))
+		return fuse_pqueue_next_bulk(pq);
+	return list_first_entry(&pq->urgent, struct fuse_req, list);
+}
+
+/*
+ * Take a request returned by fuse_pqueue_next() off the pending lists and
+ * account for it. Called with the lock of the queue held.
+ */
+static void fuse_pqueue_take(struct fuse_pqueue *pq, struct fuse_req *req)
+{
+	struct fuse_flow *flow;
+
+	list_del_init(&req->list);
+	pq->dispatched[req->prio]++;
+	if (req->prio == FUSE_PRIO_URGENT) {
+		pq->urgent_run++;
+		return;
+	}
+
+	if (!list_empty(&pq->urgent))
+		pq->promoted++;
+	pq->urgent_run = 0;
+
+	flow = req->flow;
+	flow->deficit -= fuse_req_cost(req);
+	if (list_empty(&flow->pending))
+		list_del_init(&flow->active);
+}
+
+/* Remove a cancelled request from the pending lists, with the queue locked */
+static void fuse_pqueue_del(struct fuse_pqueue *pq, struct fuse_req *req)
+{
+	struct fuse_flow *flow;
+
+	list_del_init(&req->list);
+	if (req->prio == FUSE_PRIO_URGENT)
+		return;
+
+	flow = req->flow;
+	if (list_empty(&flow->pending))
+		list_del_init(&flow->active);
+}
+
+void fuse_prio_stats(struct fuse_conn *fc, u64 *dispatched, u64 *promoted)
+{
+	struct fuse_pqueue *pq;
+	u32 i, prio;
+
+	memset(dispatched, 0, FUSE_PRIO_MAX * sizeof(*dispatched));
+	*promoted = 0;
+	for (i = 0; i < fc->nr_queues; ++i) {
+		pq = &fc->queues[i];
+		for (prio = 0; prio < FUSE_PRIO_MAX; ++prio)
+			dispatched[prio] += READ_ONCE(pq->dispatched[prio]);
+		*promoted += READ_ONCE(pq->promoted);
+	}
+}
+
+extern uint32_t pxd_inline_write_size;
+
+/* Check if the payload of a request can follow its header, see PXD_FLAGS_INLINE */
+static bool fuse_req_can_inline(struct fuse_req *req)
+{
+	return req->in.h.opcode == PXD_WRITE && req->pxd_rdwr_in.size &&
+		req->pxd_rdwr_in.size <= READ_ONCE(pxd_inline_write_size) &&
+		!(req->pxd_rdwr_in.offset & PXD_LBS_MASK) &&
+		!(req->pxd_rdwr_in.flags & (PXD_FLAGS_ZERO_MAP | PXD_FLAGS_CSUM));
 }
 
-static void queue_request(struct fuse_conn *fc, struct fuse_req *req)
+/* Set or clear PXD_FLAGS_INLINE, the header length covers the payload */
+static void fuse_req_set_inline(struct fuse_req *req, bool inline_data)
 {
-	list_add_tail(&req->list, &fc->pending);
+	if (!!(req->pxd_rdwr_in.flags & PXD_FLAGS_INLINE) == inline_data)
+		return;
+
+	if (inline_data) {
+		req->pxd_rdwr_in.flags |= PXD_FLAGS_INLINE;
+		req->in.h.len += req->pxd_rdwr_in.size;
+	} else {
+		req->pxd_rdwr_in.flags &= ~PXD_FLAGS_INLINE;
+		req->in.h.len -= req->pxd_rdwr_in.size;
+	}
 }
 
+/* Wake up a reader on every node */
 static void fuse_conn_wakeup(struct fuse_conn *fc)
 {
+	int node;
+
 	wake_up(&fc->waitq);
+	for (node = 0; node < nr_node_ids; ++node)
+		wake_up(&fc->node_waitq[node]);
 	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 }
 
+/*
+ * Signal readers about requests added to an empty submit list. A reader
+ * which is awake takes the whole submit list before it sleeps again, so
+ * later additions need no signal until the list has been emptied. A
+ * sleeping reader on @node is preferred, so the request data is copied
+ * on the node it was submitted on, else a reader on another node steals
+ * the request.
+ */
+static void fuse_conn_kick(struct fuse_conn *fc, int node)
+{
+	wait_queue_head_t *wq;
+	int i;
+
+	/* pairs with the barrier in prepare_to_wait() */
+	smp_mb();
+	for (i = 0; i < nr_node_ids; ++i) {
+		wq = &fc->node_waitq[(node + i) % nr_node_ids];
+		if (waitqueue_active(wq)) {
+			wake_up(wq);
+			break;
+		}
+	}
+	if (waitqueue_active(&fc->waitq))
+		wake_up(&fc->waitq);
+	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+}
+
+/* Reset the shared queue indices, the user space writer lock is kept */
+static void fuse_queue_reset_cb(struct fuse_queue_cb *cb)
+{
+	cb->w.write = 0;
+	cb->w.read = 0;
+	cb->w.sequence = 0;
+
+	cb->r.read = 0;
+	cb->r.write = 0;
+	cb->r.need_wake_up = 0;
+}
+
+/* Check if the shared request queue has entries not yet read by user space */
+static bool fuse_queue_pending(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb;
+
+	if (!READ_ONCE(fc->queue_mode))
+		return false;
+
+	cb = &fc->queue->requests_cb;
+	return READ_ONCE(fc->queue_write) !=
+		(READ_ONCE(cb->r.read) & (FUSE_REQUEST_QUEUE_SIZE - 1));
+}
+
+/*
+ * Reserve the next entry of the shared request queue. Called with the
+ * queue writer lock held, returns NULL if the queue is full.
+ */
+static struct rdwr_in *fuse_queue_reserve(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb = &fc->queue->requests_cb;
+	u32 next = (fc->queue_write + 1) & (FUSE_REQUEST_QUEUE_SIZE - 1);
+
+	if (unlikely(next == fc->queue_read)) {
+		/* pairs with the release of the read index by user space */
+		fc->queue_read = smp_load_acquire(&cb->r.read) &
+			(FUSE_REQUEST_QUEUE_SIZE - 1);
+		if (next == fc->queue_read)
+			return NULL;
+	}
+
+	return &fc->queue->requests[fc->queue_write];
+}
+
+/* Make the reserved entry visible to user space */
+static void fuse_queue_commit(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb = &fc->queue->requests_cb;
+
+	fc->queue_write = (fc->queue_write + 1) & (FUSE_REQUEST_QUEUE_SIZE - 1);
+	smp_store_release(&cb->r.write, fc->queue_write);
+}
+
+/*
+ * Publish a request on the shared request queue. Called with the queue
+ * writer lock held, returns false if the queue is full.
+ */
+static bool fuse_queue_publish(struct fuse_conn *fc, struct fuse_req *req)
+{
+	struct rdwr_in *entry = fuse_queue_reserve(fc);
+
+	if (!entry)
+		return false;
+
+	/* restarted requests may have been inlined before */
+	fuse_req_set_inline(req, false);
+	/* entries carry no arguments beyond rdwr, the zero map is a hint only */
+	if (req->pxd_rdwr_in.flags & PXD_FLAGS_ZERO_MAP) {
+		req->pxd_rdwr_in.flags &= ~PXD_FLAGS_ZERO_MAP;
+		req->in.h.len -= req->in.args[1].size;
+		req->in.numargs = 1;
+	}
+	entry->in = req->in.h;
+	entry->rdwr = req->pxd_rdwr_in;
+	fuse_req_sent(req);
+	fuse_queue_commit(fc);
+
+	return true;
+}
+
+/*
+ * Wake up the queue reader if it went to sleep. The reader sets
+ * need_wake_up, or is on a wait queue, before checking the write index
+ * one last time, the full barrier orders our write index update against
+ * that check. Readers blocked in read wait on their node.
+ */
+static void fuse_queue_wakeup(struct fuse_conn *fc)
+{
+	int node;
+
+	smp_mb();
+	if (READ_ONCE(fc->queue->requests_cb.r.need_wake_up) ||
+	    waitqueue_active(&fc->waitq)) {
+		fuse_conn_wakeup(fc);
+		return;
+	}
+	for (node = 0; node < nr_node_ids; ++node) {
+		if (waitqueue_active(&fc->node_waitq[node]))
+			wake_up(&fc->node_waitq[node]);
+	}
+}
+
+/* Number of entries on the request queue not yet read by user space */
+static u32 fuse_queue_count(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb = &fc->queue->requests_cb;
+
+	return (READ_ONCE(fc->queue_write) - READ_ONCE(cb->r.read)) &
+		(FUSE_REQUEST_QUEUE_SIZE - 1);
+}
+
+long fuse_queue_wait(struct fuse_conn *fc, u32 timeout_ms)
+{
+	long rc;
+
+	if (!READ_ONCE(fc->queue_mode))
+		return -EINVAL;
+
+	if (timeout_ms && !fuse_queue_count(fc)) {
+		rc = wait_event_interruptible_timeout(fc->waitq,
+			fuse_queue_count(fc) || !READ_ONCE(fc->connected),
+			msecs_to_jiffies(timeout_ms));
+		if (rc < 0)
+			return rc;
+		if (!READ_ONCE(fc->connected))
+			return -ENODEV;
+	}
+
+	return fuse_queue_count(fc);
+}
+
+/*
+ * Try to hand a request to user space through the shared request queue.
+ * Returns false if the queue is not in use or is full, the request then
+ * has to go on the pending list.
+ */
+static bool fuse_queue_send(struct fuse_conn *fc, struct fuse_req *req)
+{
+	bool sent = false;
+
+	if (!READ_ONCE(fc->queue_mode))
+		return false;
+
+	spin_lock(&fc->queue_lock);
+	if (fc->queue_mode) {
+		sent = fuse_queue_publish(fc, req);
+		if (unlikely(!sent))
+			printk_ratelimited(KERN_WARNING
+				"%s: request queue full\n", __func__);
+	}
+	spin_unlock(&fc->queue_lock);
+
+	if (likely(sent))
+		fuse_queue_wakeup(fc);
+
+	return sent;
+}
+
+/*
+ * Move the requests of @pq over to the shared request queue, as far as
+ * they fit. Called with the lock of the queue held.
+ */
+static void fuse_pqueue_publish(struct fuse_conn *fc, struct fuse_pqueue *pq)
+{
+	struct fuse_req *req;
+
+	fuse_pqueue_flush(pq);
+	spin_lock(&fc->queue_lock);
+	while ((req = fuse_pqueue_next(pq)) != NULL) {
+		if (!fuse_queue_publish(fc, req))
+			break;
+		fuse_pqueue_take(pq, req);
+	}
+	spin_unlock(&fc->queue_lock);
+}
+
+/*
+ * Switch the connection to the shared request queue and move requests
+ * which are still pending over to it. Submitters recheck queue_mode after
+ * adding to the submit list of their queue and publish it themselves if
+ * it got set, so no request is left behind on a queue drained here.
+ */
+static void fuse_queue_enable(struct fuse_conn *fc)
+{
+	struct fuse_pqueue *pq;
+	bool enable;
+	u32 i;
+
+	spin_lock(&fc->lock);
+	spin_lock(&fc->queue_lock);
+	enable = !fc->queue_mode;
+	fc->queue_mode = true;
+	spin_unlock(&fc->queue_lock);
+
+	for (i = 0; enable && i < fc->nr_queues; ++i) {
+		pq = &fc->queues[i];
+		spin_lock(&pq->lock);
+		fuse_pqueue_publish(fc, pq);
+		spin_unlock(&pq->lock);
+	}
+	spin_unlock(&fc->lock);
+
+	fuse_conn_wakeup(fc);
+}
+
+/*
+ * Stop using the shared request queue. Requests published on it which
+ * have not been answered stay in flight like the requests read by user
+ * space. Called with fc->lock held.
+ */
+static void fuse_queue_reset(struct fuse_conn *fc)
+{
+	if (!fc->queue)
+		return;
+
+	/* nothing gets published once queue mode is off */
+	spin_lock(&fc->queue_lock);
+	fc->queue_mode = false;
+	fc->queue_write = 0;
+	fc->queue_read = 0;
+	fuse_queue_reset_cb(&fc->queue->requests_cb);
+	spin_unlock(&fc->queue_lock);
+
+	WRITE_ONCE(fc->user_queue_read, 0);
+	fuse_queue_reset_cb(&fc->queue->user_requests_cb);
+}
+
+/*
+ * Stop using the shared request queue once nothing maps it. Requests
+ * published but not read by user space go back to their pending queues,
+ * the ones user space read stay in flight for their replies.
+ */
+static void fuse_queue_disable(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb = &fc->queue->requests_cb;
+	struct fuse_pqueue *pq;
+	struct fuse_req *req;
+	struct rdwr_in *entry;
+	u32 read, write;
+	u64 uid;
+
+	spin_lock(&fc->lock);
+	spin_lock(&fc->queue_lock);
+	fc->queue_mode = false;
+	read = READ_ONCE(cb->r.read) & (FUSE_REQUEST_QUEUE_SIZE - 1);
+	write = fc->queue_write;
+	spin_unlock(&fc->queue_lock);
+
+	for (; read != write; read = (read + 1) & (FUSE_REQUEST_QUEUE_SIZE - 1)) {
+		entry = &fc->queue->requests[read];
+		if (entry->in.opcode == PXD_COMPLETE)
+			continue;
+
+		uid = READ_ONCE(entry->in.unique);
+		rcu_read_lock();
+		req = READ_ONCE(*fuse_request_slot(fc, uid));
+		if (req) {
+			pq = fuse_req_queue(fc, req);
+			spin_lock(&pq->lock);
+			if (atomic64_cmpxchg(&req->inflight, uid,
+					     FUSE_REQ_PENDING) == uid)
+				fuse_pqueue_add(pq, req, true);
+			spin_unlock(&pq->lock);
+		}
+		rcu_read_unlock();
+	}
+
+	fuse_queue_reset(fc);
+	spin_unlock(&fc->lock);
+
+	fuse_conn_wakeup(fc);
+}
+
 /*
  * This function is called when a request is finished.  Either a reply
  * has arrived or it was aborted (and not yet sent) or some error
@@ -211,40 +936,66 @@ static void fuse_conn_wakeup(struct fuse_conn *fc)
  * the 'end' callback is called if given, else the reference to the
  * request is released
  *
- * If called with fc->lock, unlocks it
+ * The caller has claimed the request, it is on no list.
  */
-void request_end(struct fuse_conn *fc, struct fuse_req *req,
-                        bool lock)
-__releases(fc->lock)
+void request_end(struct fuse_conn *fc, struct fuse_req *req)
 {
 	u64 uid;
 	bool shouldfree = false;
 
-	if (likely(lock)) {
-		spin_lock(&fc->lock);
-	}
-	list_del(&req->list);
-	spin_unlock(&fc->lock);
 	uid = req->in.h.unique;
+	/* no lookup finds the request once its end callback runs */
+	WRITE_ONCE(*fuse_request_slot(fc, uid), NULL);
 	if (req->end)
 		shouldfree = req->end(fc, req, req->out.h.error);
 	fuse_put_unique(fc, uid);
 	if (shouldfree) fuse_request_free(req);
 }
 
-static void fuse_request_send_nowait_locked(struct fuse_conn *fc,
-					    struct fuse_req *req)
+/*
+ * Finish @req with @error, whether it is queued or user space has it.
+ * Returns false if the request is being finished already.
+ */
+bool fuse_request_cancel(struct fuse_conn *fc, struct fuse_req *req, int error)
 {
-	queue_request(fc, req);
+	struct fuse_pqueue *pq = fuse_req_queue(fc, req);
+	bool claimed;
+
+	spin_lock(&pq->lock);
+	fuse_pqueue_flush(pq);
+	claimed = fuse_req_claim(req, FUSE_REQ_PENDING);
+	if (claimed)
+		fuse_pqueue_del(pq, req);
+	spin_unlock(&pq->lock);
+
+	/*
+	 * A reader copying the request out marks it sent or finishes it, io
+	 * ring I/O hands it back.
+	 */
+	fuse_req_wait_idle(req);
+
+	if (!claimed && !fuse_req_claim(req, req->in.h.unique))
+		return false;
+
+	req->out.h.error = error;
+	request_end(fc, req);
+	return true;
 }
 
 void fuse_request_send_nowait(struct fuse_conn *fc, struct fuse_req *req)
 {
+	struct fuse_pqueue *pq;
+	bool first;
+
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *)req->in.args);
+	req->qid = raw_smp_processor_id() % fc->nr_queues;
+	req->prio = fuse_req_prio(req);
+	pq = fuse_req_queue(fc, req);
 
 	req->in.h.unique = fuse_get_unique(fc);
-	fc->request_map[req->in.h.unique & (FUSE_MAX_REQUEST_IDS - 1)] = req;
+	atomic64_set(&req->inflight, FUSE_REQ_PENDING);
+	*fuse_request_slot(fc, req->in.h.unique) = req;
 
 	/*
 	 * Ensures checking the value of allow_disconnected and adding request to
@@ -253,50 +1004,145 @@ void fuse_request_send_nowait(struct fuse_conn *fc, struct fuse_req *req)
 	rcu_read_lock();
 
 	if (fc->connected || fc->allow_disconnected) {
-		spin_lock(&fc->lock);
-		fuse_request_send_nowait_locked(fc, req);
-		spin_unlock(&fc->lock);
+		if (fuse_queue_send(fc, req)) {
+			rcu_read_unlock();
+			return;
+		}
+
+		/* a full barrier, orders the add against the queue_mode check */
+		first = llist_add(&req->llnode, &pq->submit);
+
+		/* queue mode may have been switched on since the lockless check */
+		if (unlikely(READ_ONCE(fc->queue_mode))) {
+			spin_lock(&pq->lock);
+			fuse_pqueue_publish(fc, pq);
+			spin_unlock(&pq->lock);
+			rcu_read_unlock();
+			fuse_conn_wakeup(fc);
+			return;
+		}
 
 		rcu_read_unlock();
 
-		fuse_conn_wakeup(fc);
+		if (first)
+			fuse_conn_kick(fc, pq->node);
 	} else {
 		rcu_read_unlock();
 
+		atomic64_set(&req->inflight, 0);
 		req->out.h.error = -ENOTCONN;
-		request_end(fc, req, true);
+		request_end(fc, req);
 	}
 }
 
-static int request_pending(struct fuse_conn *fc)
+static int request_pending(struct fuse_conn *fc)
+{
+	u32 i;
+
+	for (i = 0; i < fc->nr_queues; ++i) {
+		if (!fuse_pqueue_empty(&fc->queues[i]))
+			return 1;
+	}
+	return 0;
+}
+
+/* Running CRC32C of the blocks of a write, see PXD_FLAGS_CSUM */
+struct fuse_csum {
+	struct iov_iter *iter;	/* destination of the block checksums */
+	size_t pos;		/* bytes of the current block summed */
+	u32 crc;
+};
+
+static void fuse_csum_init(struct fuse_csum *cs, struct iov_iter *iter)
 {
-	return !list_empty(&fc->pending);
+	cs->iter = iter;
+	cs->pos = 0;
+	cs->crc = ~0;
 }
 
-/* Wait until a request is available on the pending list */
-static void request_wait(struct fuse_conn *fc)
-__releases(fc->lock)
-__acquires(fc->lock)
+/*
+ * Add @len bytes of @page at @offset to the checksums, called right after
+ * the bytes were copied to user space so they are still in cache. The
+ * checksum of each completed block is copied out.
+ */
+static int fuse_csum_page(struct fuse_csum *cs, struct page *page,
+		size_t offset, size_t len)
 {
-	DECLARE_WAITQUEUE(wait, current);
-
-	add_wait_queue_exclusive(&fc->waitq, &wait);
-	while (fc->connected && !request_pending(fc)) {
-		set_current_state(TASK_INTERRUPTIBLE);
-		if (signal_pending(current))
+	size_t chunk;
+	__le32 crc;
+	char *p;
+	int ret = 0;
+
+	if (!cs)
+		return 0;
+
+	p = kmap(page) + offset;
+	while (len) {
+		chunk = min_t(size_t, len, PXD_LBS - cs->pos);
+		cs->crc = crc32c(cs->crc, p, chunk);
+		cs->pos += chunk;
+		p += chunk;
+		len -= chunk;
+		if (cs->pos < PXD_LBS)
+			continue;
+
+		crc = cpu_to_le32(~cs->crc);
+		cs->pos = 0;
+		cs->crc = ~0;
+		if (copy_to_iter(&crc, sizeof(crc), cs->iter) != sizeof(crc)) {
+			ret = -EFAULT;
 			break;
+		}
+	}
+	kunmap(page);
 
-		spin_unlock(&fc->lock);
-		schedule();
-		spin_lock(&fc->lock);
+	return ret;
+}
+
+/* Copy the data of a request to or from @iter */
+static int fuse_copy_req_data(struct fuse_req *req, struct iov_iter *iter,
+		bool to_iter, struct fuse_csum *cs)
+{
+#ifdef HAVE_BVEC_ITER
+	struct bio_vec bvec;
+#else
+	struct bio_vec *bvec = NULL;
+#endif
+#ifndef __PXD_BIO_MAKEREQ__
+	struct req_iterator breq_iter;
+#elif defined(HAVE_BVEC_ITER)
+	struct bvec_iter breq_iter;
+#else
+	int breq_iter;
+#endif
+	size_t copied, len;
+
+#ifndef __PXD_BIO_MAKEREQ__
+	rq_for_each_segment(bvec, req->rq, breq_iter) {
+#else
+	bio_for_each_segment(bvec, req->bio, breq_iter) {
+#endif
+		len = BVEC(bvec).bv_len;
+		if (to_iter)
+			copied = copy_page_to_iter(BVEC(bvec).bv_page,
+					BVEC(bvec).bv_offset, len, iter);
+		else
+			copied = copy_page_from_iter(BVEC(bvec).bv_page,
+					BVEC(bvec).bv_offset, len, iter);
+		if (copied != len)
+			return -EFAULT;
+		if (fuse_csum_page(cs, BVEC(bvec).bv_page, BVEC(bvec).bv_offset,
+				len))
+			return -EFAULT;
 	}
-	set_current_state(TASK_RUNNING);
-	remove_wait_queue(&fc->waitq, &wait);
+
+	return 0;
 }
 
 static ssize_t fuse_copy_req_read(struct fuse_req *req, struct iov_iter *iter)
 {
 	size_t copied, len;
+	unsigned i;
 
 	copied = sizeof(req->in.h);
 	if (copy_to_iter(&req->in.h, copied, iter) != copied) {
@@ -304,44 +1150,130 @@ static ssize_t fuse_copy_req_read(struct fuse_req *req, struct iov_iter *iter)
 		return -EFAULT;
 	}
 
-	len = req->in.args[0].size;
-	if (copy_to_iter((void *)req->in.args[0].value, len, iter) != len) {
-		printk(KERN_ERR "%s: copy arg error\n", __func__);
-		return -EFAULT;
+	for (i = 0; i < req->in.numargs; i++) {
+		len = req->in.args[i].size;
+		if (copy_to_iter((void *)req->in.args[i].value, len, iter) != len) {
+			printk(KERN_ERR "%s: copy arg error\n", __func__);
+			return -EFAULT;
+		}
+		copied += len;
+	}
+
+	if (req->pxd_rdwr_in.flags & PXD_FLAGS_INLINE) {
+		if (fuse_copy_req_data(req, iter, true, NULL)) {
+			printk(KERN_ERR "%s: copy inline data error\n", __func__);
+			return -EFAULT;
+		}
+		copied += req->pxd_rdwr_in.size;
 	}
-	copied += len;
 
 	return copied;
 }
 
-extern uint32_t pxd_detect_zero_writes;
-
-static bool __check_zero_page_write(char *base, size_t len) {
-	uint8_t wsize = sizeof(uint64_t);
-	char *p;
-	size_t i;
-	uint64_t *q;
-
-	p = base;
-	q = (uint64_t *)p;
-	for (i = 0; i < (len / wsize); i++) {
-		if (q[i]) {
+/*
+ * Check if a buffer is all zeroes. A cache line worth of words is OR-ed
+ * together per iteration, which keeps the loop at memory bandwidth without
+ * the cost of saving FPU state for vector registers, and bails out at the
+ * first cache line with a bit set. Unaligned head and tail bytes, which
+ * are rare for block IO, are left to memchr_inv().
+ */
+static bool __check_zero_page_write(char *base, size_t len)
+{
+	const size_t line = 8 * sizeof(unsigned long);
+	size_t head = -(unsigned long)base & (sizeof(unsigned long) - 1);
+	const unsigned long *p;
+	size_t n;
+
+	head = min(head, len);
+	if (head && memchr_inv(base, 0, head))
+		return false;
+
+	p = (const unsigned long *)(base + head);
+	len -= head;
+	for (n = len / line; n; --n, p += 8) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
 			return false;
-		}
 	}
-	for (i = len - (len % wsize); i < len; i++) {
-		if (p[i]) {
-			return false;
-		}
+
+	len &= line - 1;
+	return !len || !memchr_inv(p, 0, len);
+}
+
+extern uint32_t pxd_detect_zero_writes;
+
+/*
+ * Check a segment of a write at byte @pos of the request. Without a
+ * block map returns whether the segment is all zero. With a map, marks
+ * the blocks the segment has data in and returns true so the whole
+ * request gets scanned.
+ */
+static bool fuse_zero_segment(unsigned long *data, size_t pos, char *p,
+		size_t len)
+{
+	size_t block, chunk;
+
+	if (!data)
+		return __check_zero_page_write(p, len);
+
+	while (len) {
+		block = pos / PXD_LBS;
+		chunk = min_t(size_t, len, PXD_LBS - (pos & PXD_LBS_MASK));
+		if (!test_bit(block, data) && !__check_zero_page_write(p, chunk))
+			__set_bit(block, data);
+		pos += chunk;
+		p += chunk;
+		len -= chunk;
 	}
+
 	return true;
 }
 
-/* Check if the request is writing zeroes and if so, convert it as a discard
- * request.
+/*
+ * Whether zero blocks of @req are worth a map, user space can then skip
+ * them when writing out the request. Only whole blocks can be described.
+ */
+static bool fuse_zero_map_wanted(struct fuse_req *req)
+{
+	return READ_ONCE(pxd_detect_zero_writes) >= 2 &&
+		!(req->pxd_rdwr_in.offset & PXD_LBS_MASK) &&
+		!(req->pxd_rdwr_in.size & PXD_LBS_MASK) &&
+		req->pxd_rdwr_in.size <= PXD_MAX_IO;
+}
+
+/*
+ * Finish the scan of a write. An all zero write is converted to a
+ * discard, a write with some zero blocks gets the map of them as its
+ * second argument, see PXD_FLAGS_ZERO_MAP.
+ */
+static void fuse_zero_map_set(struct fuse_req *req, unsigned long *data)
+{
+	size_t blocks = req->pxd_rdwr_in.size / PXD_LBS;
+	size_t words = DIV_ROUND_UP(blocks, 64);
+	unsigned long block;
+
+	if (bitmap_empty(data, blocks)) {
+		req->in.h.opcode = PXD_DISCARD;
+		return;
+	}
+	if (bitmap_full(data, blocks))
+		return;
+
+	memset(req->zero_map, 0, words * sizeof(uint64_t));
+	for_each_clear_bit(block, data, blocks)
+		req->zero_map[block / 64] |= 1ULL << (block % 64);
+
+	req->pxd_rdwr_in.flags |= PXD_FLAGS_ZERO_MAP;
+	req->in.numargs = 2;
+	req->in.args[1].size = words * sizeof(uint64_t);
+	req->in.args[1].value = req->zero_map;
+}
+
+/*
+ * Scan the data of a write. Without a block map returns whether the data
+ * is all zero, else fills the map and returns true.
  */
 #ifndef __PXD_BIO_MAKEREQ__
-static void __fuse_convert_zero_writes(struct fuse_req *req)
+static bool fuse_scan_zero(struct fuse_req *req, unsigned long *map)
 {
 	struct req_iterator breq_iter;
 
@@ -350,23 +1282,25 @@ static void __fuse_convert_zero_writes(struct fuse_req *req)
 #else
 	struct bio_vec *bvec = NULL;
 #endif
+	size_t len, pos = 0;
 	char *kaddr, *p;
-	size_t len;
+	bool zero;
 
 	rq_for_each_segment(bvec, req->rq, breq_iter) {
 		kaddr = kmap_atomic(BVEC(bvec).bv_page);
 		p = kaddr + BVEC(bvec).bv_offset;
 		len = BVEC(bvec).bv_len;
-		if (!__check_zero_page_write(p, len)) {
-			kunmap_atomic(kaddr);
-			return;
-		}
+		zero = fuse_zero_segment(map, pos, p, len);
 		kunmap_atomic(kaddr);
+		if (!zero)
+			return false;
+		pos += len;
 	}
-	req->in.h.opcode = PXD_DISCARD;
+
+	return true;
 }
 #else
-static void __fuse_convert_zero_writes(struct fuse_req *req)
+static bool fuse_scan_zero(struct fuse_req *req, unsigned long *map)
 {
 #if defined(HAVE_BVEC_ITER)
 	struct bvec_iter bvec_iter;
@@ -375,128 +1309,275 @@ static void __fuse_convert_zero_writes(struct fuse_req *req)
 	int bvec_iter;
 	struct bio_vec *bvec = NULL;
 #endif
+	size_t len, pos = 0;
 	char *kaddr, *p;
-	size_t len;
+	bool zero;
 
 	bio_for_each_segment(bvec, req->bio, bvec_iter) {
 		kaddr = kmap_atomic(BVEC(bvec).bv_page);
 		p = kaddr + BVEC(bvec).bv_offset;
 		len = BVEC(bvec).bv_len;
-		if (!__check_zero_page_write(p, len)) {
-			kunmap_atomic(kaddr);
-			return;
-		}
+		zero = fuse_zero_segment(map, pos, p, len);
 		kunmap_atomic(kaddr);
+		if (!zero)
+			return false;
+		pos += len;
 	}
-	req->in.h.opcode = PXD_DISCARD;
+
+	return true;
 }
 #endif
 
+bool fuse_req_data_zero(struct fuse_req *req)
+{
+	return fuse_scan_zero(req, NULL);
+}
+
+/* Check if the request is writing zeroes and if so, convert it as a discard
+ * request. Partially zero writes get a map of their zero blocks if enabled.
+ */
 void fuse_convert_zero_writes(struct fuse_req *req)
 {
-	__fuse_convert_zero_writes(req);
+	DECLARE_BITMAP(data, PXD_ZERO_MAP_BLOCKS);
+
+	if (!fuse_zero_map_wanted(req)) {
+		if (fuse_scan_zero(req, NULL))
+			req->in.h.opcode = PXD_DISCARD;
+		return;
+	}
+
+	bitmap_zero(data, PXD_ZERO_MAP_BLOCKS);
+	fuse_scan_zero(req, data);
+	fuse_zero_map_set(req, data);
 }
 
 /*
- * Read a single request into the userspace filesystem's buffer.  This
- * function waits until a request is available, then removes it from
- * the pending list and copies request data to userspace buffer.  If
- * no reply is needed (FORGET) or request has been aborted or there
- * was an error during the copying then it's finished by calling
- * request_end().  Otherwise add it to the processing list, and set
- * the 'sent' flag.
+ * Hand a request copied out by a reader to user space. An abort which ran
+ * during the copy skipped the request, finish it here unless a reply or
+ * the abort got it after all. The full barrier pairs with the one in
+ * fuse_end_queued_requests().
  */
-static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
+static void fuse_req_sent_copied(struct fuse_conn *fc, struct fuse_req *req)
+{
+	u64 uid = req->in.h.unique;
+
+	fuse_req_sent(req);
+	smp_mb();
+	if (likely(READ_ONCE(fc->connected)))
+		return;
+
+	rcu_read_lock();
+	if (fuse_req_claim(req, uid)) {
+		req->out.h.error = -ECONNABORTED;
+		request_end(fc, req);
+	}
+	rcu_read_unlock();
+}
+
+/*
+ * Take a batch of requests which fit in @iter off the pending lists of
+ * @pq and copy them to the userspace buffer. If there was an error during
+ * the copying the request is finished by calling request_end(). Returns
+ * the number of bytes copied, zero if there was nothing pending or
+ * -EINVAL if the first request does not fit.
+ */
+static ssize_t fuse_pqueue_read(struct fuse_conn *fc, struct fuse_pqueue *pq,
 	struct iov_iter *iter)
 {
 	int err;
-	struct fuse_req *req;
-	struct list_head *entry, *first, *last, tmp, *next;
+	struct fuse_req *req, *next;
 	ssize_t copied = 0, copied_this_time;
 	ssize_t remain = iter->count;
-
-	INIT_LIST_HEAD(&tmp);
-
-	spin_lock(&fc->lock);
-	if (!request_pending(fc)) {
-		err = -EAGAIN;
-		if ((file->f_flags & O_NONBLOCK) && fc->connected)
-			goto err_unlock;
-		request_wait(fc);
-		err = -ENODEV;
-		if (!fc->connected)
-			goto err_unlock;
-		err = -ERESTARTSYS;
-		if (!request_pending(fc))
-			goto err_unlock;
-	}
-
-retry:
-	entry = fc->pending.next;
-	first = fc->pending.next;
-	last = &fc->pending;
-	while (entry != &fc->pending) {
-		req = list_entry(entry, struct fuse_req, list);
-		if (req->in.h.len <= remain) {
-			last = entry;
-			remain -= req->in.h.len;
-			entry = entry->next;
-		} else {
-			remain = 0;
+	LIST_HEAD(tmp);
+
+	if (fuse_pqueue_empty(pq))
+		return 0;
+
+	spin_lock(&pq->lock);
+	fuse_pqueue_flush(pq);
+	while ((req = fuse_pqueue_next(pq)) != NULL) {
+		/* restarted requests may have been inlined before */
+		fuse_req_set_inline(req, false);
+		if (fuse_req_can_inline(req) &&
+		    req->in.h.len + req->pxd_rdwr_in.size <= remain)
+			fuse_req_set_inline(req, true);
+		if (req->in.h.len > remain)
 			break;
-		}
+		remain -= req->in.h.len;
+		fuse_pqueue_take(pq, req);
+		atomic64_set(&req->inflight, FUSE_REQ_READING);
+		list_add_tail(&req->list, &tmp);
 	}
+	spin_unlock(&pq->lock);
 
-	err = copied ? copied : -EINVAL;
-	if (last == &fc->pending)
-		goto err_unlock;
-
-	list_cut_position(&tmp, &fc->pending, last);
-	list_splice_tail(&tmp, &fc->processing);
-	spin_unlock(&fc->lock);
+	if (list_empty(&tmp))
+		return req ? -EINVAL : 0;
 
-	entry = first;
+	/* a request may be answered and gone once it is marked sent */
 	err = 0;
-	while (1) {
-		req = list_entry(entry, struct fuse_req, list);
-
-		/* Check if a write request is writing zeroes */
-		if (pxd_detect_zero_writes && (req->in.h.opcode == PXD_WRITE) &&
-		    req->pxd_rdwr_in.size &&
-		    !(req->pxd_rdwr_in.flags & PXD_FLAGS_SYNC)) {
-			fuse_convert_zero_writes(req);
-		}
-		next = entry->next;
+	list_for_each_entry_safe(req, next, &tmp, list) {
 		copied_this_time = fuse_copy_req_read(req, iter);
 		if (likely(copied_this_time > 0)) {
 			copied += copied_this_time;
-		} else {
+			fuse_req_sent_copied(fc, req);
+		} else if (fuse_req_claim(req, FUSE_REQ_READING)) {
 			err = copied_this_time;
 			req->out.h.error = -EIO;
-			request_end(fc, req, true);
+			request_end(fc, req);
 		}
-		if (entry == last)
-			break;
-		entry = next;
-	}
-	if (!copied) {
-		copied = err;
 	}
 
-	/* Check if more requests could be picked up */
-	if (remain && request_pending(fc)) {
-		INIT_LIST_HEAD(&tmp);
-		spin_lock(&fc->lock);
-		if (request_pending(fc)) {
-			goto retry;
+	return copied ? copied : err;
+}
+
+void fuse_set_poll(struct fuse_conn *fc, u32 max_spin_us)
+{
+	u64 max_ns = (u64)max_spin_us * NSEC_PER_USEC;
+
+	/* start out spinning for the full time */
+	WRITE_ONCE(fc->poll_avg_ns, max_ns / 2);
+	WRITE_ONCE(fc->poll_max_ns, max_ns);
+}
+
+static void fuse_poll_account(struct fuse_conn *fc, u64 wait_ns)
+{
+	u64 avg = READ_ONCE(fc->poll_avg_ns);
+
+	/* racy updates from concurrent readers only lose a sample */
+	WRITE_ONCE(fc->poll_avg_ns, avg - (avg >> 3) + (wait_ns >> 3));
+}
+
+/*
+ * Spin for requests before sleeping, for twice the average wait but no
+ * longer than poll_max_ns. Readers do not spin when the average wait
+ * exceeds the limit, sleeping then costs little compared to the wait.
+ * Returns true if requests showed up.
+ */
+static bool fuse_dev_spin(struct fuse_conn *fc, u64 start)
+{
+	u64 max_ns = READ_ONCE(fc->poll_max_ns);
+	u64 avg = READ_ONCE(fc->poll_avg_ns);
+	u64 budget, now;
+
+	if (!max_ns || avg > max_ns)
+		return false;
+
+	budget = min(avg * 2, max_ns);
+	do {
+		if (request_pending(fc))
+			return true;
+		if (need_resched() || signal_pending(current) ||
+		    !READ_ONCE(fc->connected))
+			break;
+		cpu_relax();
+		now = ktime_to_ns(ktime_get());
+	} while (now - start < budget);
+
+	return false;
+}
+
+/*
+ * Copy requests from the queues of @node, starting with queue @qid, then
+ * steal from the queues of the other nodes. Returns the number of bytes
+ * copied, or a negative error if the first request does not fit.
+ */
+static ssize_t fuse_dev_read_queues(struct fuse_conn *fc,
+	struct iov_iter *iter, u32 qid, int node)
+{
+	struct fuse_pqueue *pq;
+	ssize_t copied = 0, ret;
+	int pass;
+	u32 i;
+
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0; i < fc->nr_queues; ++i) {
+			pq = &fc->queues[(qid + i) % fc->nr_queues];
+			if ((pq->node == node) == !!pass)
+				continue;
+			ret = fuse_pqueue_read(fc, pq, iter);
+			/* buffer full or out of space for a request */
+			if (ret < 0)
+				return copied ? copied : ret;
+			copied += ret;
 		}
-		spin_unlock(&fc->lock);
 	}
+
 	return copied;
+}
 
- err_unlock:
-	spin_unlock(&fc->lock);
-	return err;
+static bool fuse_user_queue_pending(struct fuse_conn *fc);
+static int fuse_try_run_user_queue(struct fuse_conn *fc);
+
+/*
+ * Read requests into the userspace filesystem's buffer.  This function
+ * waits until a request is available, then copies as many requests as
+ * fit.  A reader passing a non zero position (pread) of queue index + 1
+ * starts with that queue, others start with the next queue in turn. Both
+ * prefer the queues of their NUMA node, the node of the CPU they run on
+ * or of the queue they asked for, and sleep on the wait queue of that
+ * node. They go on to steal requests from the other queues.
+ */
+static ssize_t fuse_dev_do_read(struct fuse_conn *fc, struct file *file,
+	struct iov_iter *iter, loff_t pos)
+{
+	ssize_t ret;
+	u64 start = 0;
+	u32 qid;
+	int node, completed;
+
+	if (pos < 0 || pos > fc->nr_queues)
+		return -EINVAL;
+
+	/* complete what user space posted before waiting for more */
+	completed = fuse_try_run_user_queue(fc);
+
+	if (pos) {
+		qid = pos - 1;
+		node = fc->queues[qid].node;
+	} else {
+		qid = (u32)atomic_inc_return(&fc->next_queue) % fc->nr_queues;
+		node = numa_node_id();
+	}
+
+	while (1) {
+		ret = fuse_dev_read_queues(fc, iter, qid, node);
+		if (ret > 0) {
+			/* hand what did not fit to another reader */
+			if (request_pending(fc))
+				fuse_conn_kick(fc, node);
+			if (start)
+				fuse_poll_account(fc,
+					ktime_to_ns(ktime_get()) - start);
+			return ret;
+		}
+		if (ret < 0)
+			return ret;
+
+		/*
+		 * Return to user space for completions made and for requests
+		 * published on the shared queue, they are not read here.
+		 */
+		if (completed || fuse_queue_pending(fc))
+			return 0;
+
+		if (!request_pending(fc)) {
+			if ((file->f_flags & O_NONBLOCK) && fc->connected)
+				return -EAGAIN;
+			if (READ_ONCE(fc->poll_max_ns) && !start)
+				start = ktime_to_ns(ktime_get());
+			if (start && fuse_dev_spin(fc, start))
+				continue;
+			if (wait_event_interruptible_exclusive(
+					fc->node_waitq[node],
+					!fc->connected || request_pending(fc) ||
+					fuse_queue_pending(fc) ||
+					fuse_user_queue_pending(fc)))
+				return -ERESTARTSYS;
+			if (!fc->connected)
+				return -ENODEV;
+			completed = fuse_try_run_user_queue(fc);
+		}
+	}
 }
 
 
@@ -511,7 +1592,7 @@ static ssize_t fuse_dev_read(struct kiocb *iocb, const struct iovec *iov,
 		return -EPERM;
 	iov_iter_init(&iter, READ, iov, nr_segs, iov_length(iov, nr_segs));
 
-	return fuse_dev_do_read(fc, file, &iter);
+	return fuse_dev_do_read(fc, file, &iter, pos);
 }
 #else
 static ssize_t fuse_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
@@ -521,7 +1602,7 @@ static ssize_t fuse_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
 	if (!fc)
 		return -EPERM;
 
-	return fuse_dev_do_read(fc, file, to);
+	return fuse_dev_do_read(fc, file, to, iocb->ki_pos);
 }
 #endif
 
@@ -581,11 +1662,10 @@ static int fuse_notify_add_ext(struct fuse_conn *conn, unsigned int size,
 }
 
 
-/* Look up request on processing list by unique ID */
+/* Look up a request by unique ID, without locking */
 struct fuse_req *request_find(struct fuse_conn *fc, u64 unique)
 {
-	u32 index = unique & (FUSE_MAX_REQUEST_IDS - 1);
-	struct fuse_req *req = fc->request_map[index];
+	struct fuse_req *req = READ_ONCE(*fuse_request_slot(fc, unique));
 	if (req == NULL) {
 		printk(KERN_ERR "no request unique %llx", unique);
 		return req;
@@ -636,7 +1716,8 @@ static int copy_in_read_data_iovec(struct iov_iter *iter,
 #ifndef __PXD_BIO_MAKEREQ__
 static int __fuse_notify_read_data(struct fuse_conn *conn,
 		struct fuse_req *req,
-		struct pxd_read_data_out *read_data_p, struct iov_iter *iter)
+		struct pxd_read_data_out *read_data_p, struct iov_iter *iter,
+		struct fuse_csum *cs)
 {
 	struct iovec iov[IOV_BUF_SIZE];
 	struct iov_iter data_iter;
@@ -646,7 +1727,7 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 	struct bio_vec *bvec = NULL;
 #endif
 	struct req_iterator breq_iter;
-	size_t copied, skipped = 0;
+	size_t copied, start, skipped = 0;
 	int ret;
 
 	ret = copy_in_read_data_iovec(iter, read_data_p, iov, &data_iter);
@@ -674,9 +1755,12 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 			size_t copy_this = copy_page_to_iter(BVEC(bvec).bv_page,
 				BVEC(bvec).bv_offset + copied,
 				len - copied, &data_iter);
+			start = copied;
 			if (copy_this != len - copied) {
 				if (!iter->count)
-					return 0;
+					return fuse_csum_page(cs, BVEC(bvec).bv_page,
+						BVEC(bvec).bv_offset + start,
+						copy_this);
 
 				/* out of space in destination, copy more iovec */
 				ret = copy_in_read_data_iovec(iter, read_data_p,
@@ -693,6 +1777,11 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 					return -EFAULT;
 				}
 			}
+			ret = fuse_csum_page(cs, BVEC(bvec).bv_page,
+				BVEC(bvec).bv_offset + start,
+				BVEC(bvec).bv_len - start);
+			if (ret)
+				return ret;
 		}
 	}
 
@@ -702,7 +1791,8 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 #else
 static int __fuse_notify_read_data(struct fuse_conn *conn,
 		struct fuse_req *req,
-		struct pxd_read_data_out *read_data_p, struct iov_iter *iter)
+		struct pxd_read_data_out *read_data_p, struct iov_iter *iter,
+		struct fuse_csum *cs)
 {
 	struct iovec iov[IOV_BUF_SIZE];
 	struct iov_iter data_iter;
@@ -713,7 +1803,7 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 	struct bio_vec *bvec = NULL;
 	int bvec_iter;
 #endif
-	size_t copied, skipped = 0;
+	size_t copied, start, skipped = 0;
 	int ret;
 
 	ret = copy_in_read_data_iovec(iter, read_data_p, iov, &data_iter);
@@ -741,9 +1831,12 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 			size_t copy_this = copy_page_to_iter(BVEC(bvec).bv_page,
 				BVEC(bvec).bv_offset + copied,
 				len - copied, &data_iter);
+			start = copied;
 			if (copy_this != len - copied) {
 				if (!iter->count)
-					return 0;
+					return fuse_csum_page(cs, BVEC(bvec).bv_page,
+						BVEC(bvec).bv_offset + start,
+						copy_this);
 
 				/* out of space in destination, copy more iovec */
 				ret = copy_in_read_data_iovec(iter, read_data_p,
@@ -760,43 +1853,370 @@ static int __fuse_notify_read_data(struct fuse_conn *conn,
 					return -EFAULT;
 				}
 			}
+			ret = fuse_csum_page(cs, BVEC(bvec).bv_page,
+				BVEC(bvec).bv_offset + start,
+				BVEC(bvec).bv_len - start);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+#endif
+
+/* Find the write request user space reads the data of */
+static struct fuse_req *fuse_find_write(struct fuse_conn *conn, u64 unique)
+{
+	struct fuse_req *req;
+
+	req = request_find(conn, unique);
+	if (!req) {
+		printk(KERN_ERR "%s: request %lld not found\n", __func__,
+		       unique);
+		return ERR_PTR(-ENOENT);
+	}
+
+	if (req->in.h.opcode != PXD_WRITE &&
+	    req->in.h.opcode != PXD_WRITE_SAME) {
+		printk(KERN_ERR "%s: request is not a write\n", __func__);
+		return ERR_PTR(-EINVAL);
+	}
+
+	return req;
+}
+
+static int fuse_notify_read_data(struct fuse_conn *conn, unsigned int size,
+				struct iov_iter *iter)
+{
+	struct pxd_read_data_out read_data;
+	size_t len = sizeof(read_data);
+	struct fuse_req *req;
+
+	if (copy_from_iter(&read_data, len, iter) != len) {
+		printk(KERN_ERR "%s: can't copy read_data arg\n", __func__);
+		return -EFAULT;
+	}
+
+	req = fuse_find_write(conn, read_data.unique);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	return __fuse_notify_read_data(conn, req, &read_data, iter, NULL);
+}
+
+static int fuse_notify_read_data_csum(struct fuse_conn *conn,
+		unsigned int size, struct iov_iter *iter)
+{
+	struct pxd_read_data_csum_out read_data;
+	size_t len = sizeof(read_data);
+	struct iov_iter csum_iter;
+	struct iovec csum_iov;
+	struct fuse_csum cs;
+	struct fuse_req *req;
+
+	if (copy_from_iter(&read_data, len, iter) != len) {
+		printk(KERN_ERR "%s: can't copy read_data arg\n", __func__);
+		return -EFAULT;
+	}
+
+	req = fuse_find_write(conn, read_data.rd.unique);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	if (!(req->pxd_rdwr_in.flags & PXD_FLAGS_CSUM) ||
+	    (read_data.rd.offset & PXD_LBS_MASK) ||
+	    read_data.rd.offset > req->pxd_rdwr_in.size) {
+		printk(KERN_ERR "%s: no checksums at offset %u\n", __func__,
+		       read_data.rd.offset);
+		return -EINVAL;
+	}
+
+	csum_iov.iov_base = (void __user *)(uintptr_t)read_data.csum;
+	csum_iov.iov_len = PXD_CSUM_SIZE(req->pxd_rdwr_in.size -
+		read_data.rd.offset);
+	iov_iter_init(&csum_iter, READ, &csum_iov, 1, csum_iov.iov_len);
+	fuse_csum_init(&cs, &csum_iter);
+
+	return __fuse_notify_read_data(conn, req, &read_data.rd, iter, &cs);
+}
+
+static int fuse_dev_reply(struct fuse_conn *fc, struct fuse_out_header *oh,
+		struct iov_iter *iter);
+
+static void fuse_free_buffers(struct fuse_buffers *bufs)
+{
+	u32 i;
+
+	for (i = 0; i < bufs->nr_pages; ++i) {
+		/* write payloads were copied into the pages */
+		set_page_dirty_lock(bufs->pages[i]);
+		UNPIN_USER_PAGE(bufs->pages[i]);
+	}
+	if (bufs->mm) {
+		MM_PINNED_SUB(bufs->mm, bufs->nr_charged);
+		mmdrop(bufs->mm);
+	}
+	vfree(bufs->bvecs);
+	vfree(bufs->pages);
+	kfree(bufs);
+}
+
+int fuse_unregister_buffers(struct fuse_conn *fc)
+{
+	struct fuse_buffers *bufs;
+
+	down_write(&fc->buffers_sem);
+	bufs = fc->buffers;
+	fc->buffers = NULL;
+	up_write(&fc->buffers_sem);
+
+	if (!bufs)
+		return -ENXIO;
+
+	fuse_free_buffers(bufs);
+	return 0;
+}
+
+#ifdef IOV_ITER_BVEC
+/*
+ * Charge the arena to the pinned memory of the registering process, the
+ * pages stay pinned for as long as the connection holds them. Processes
+ * without CAP_IPC_LOCK stay within RLIMIT_MEMLOCK.
+ */
+static int fuse_account_buffers(struct fuse_buffers *bufs, u32 nr_pages)
+{
+	unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+	struct mm_struct *mm = current->mm;
+
+	if (MM_PINNED_ADD(mm, nr_pages) > limit && !capable(CAP_IPC_LOCK)) {
+		MM_PINNED_SUB(mm, nr_pages);
+		return -ENOMEM;
+	}
+
+	MMGRAB(mm);
+	bufs->mm = mm;
+	bufs->nr_charged = nr_pages;
+	return 0;
+}
+
+int fuse_register_buffers(struct fuse_conn *fc, u64 addr, u64 len,
+		u32 buf_size)
+{
+	struct fuse_buffers *bufs;
+	u32 nr_pages, i;
+	int rc;
+
+	if (!buf_size || (buf_size & ~PAGE_MASK) || (addr & ~PAGE_MASK) ||
+	    !len || len > FUSE_MAX_BUFFERS_SIZE || len % buf_size ||
+	    len / buf_size > FUSE_USER_MAX_BUFFERS)
+		return -EINVAL;
+
+	bufs = kzalloc(sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+
+	nr_pages = len >> PAGE_SHIFT;
+	rc = fuse_account_buffers(bufs, nr_pages);
+	if (rc)
+		goto out;
+
+	bufs->pages = vzalloc(nr_pages * sizeof(*bufs->pages));
+	bufs->bvecs = vzalloc(nr_pages * sizeof(*bufs->bvecs));
+	if (!bufs->pages || !bufs->bvecs) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	while (bufs->nr_pages < nr_pages) {
+		rc = PIN_USER_PAGES_FAST(addr + ((u64)bufs->nr_pages << PAGE_SHIFT),
+			nr_pages - bufs->nr_pages, bufs->pages + bufs->nr_pages);
+		if (rc <= 0) {
+			rc = rc ? rc : -EFAULT;
+			goto out;
 		}
+		bufs->nr_pages += rc;
+	}
+
+	for (i = 0; i < nr_pages; ++i) {
+		bufs->bvecs[i].bv_page = bufs->pages[i];
+		bufs->bvecs[i].bv_offset = 0;
+		bufs->bvecs[i].bv_len = PAGE_SIZE;
+	}
+	bufs->pages_per_buf = buf_size >> PAGE_SHIFT;
+	bufs->nr_bufs = len / buf_size;
+
+	down_write(&fc->buffers_sem);
+	if (fc->buffers) {
+		up_write(&fc->buffers_sem);
+		rc = -EBUSY;
+		goto out;
+	}
+	fc->buffers = bufs;
+	up_write(&fc->buffers_sem);
+
+	return bufs->nr_bufs;
+
+out:
+	printk(KERN_ERR "%s: register %llu bytes at %llx failed: %d\n",
+		__func__, len, addr, rc);
+	fuse_free_buffers(bufs);
+	return rc;
+}
+
+int fuse_get_buffer(struct fuse_conn *fc, u32 index, int dir, size_t len,
+		struct iov_iter *iter)
+{
+	struct fuse_buffers *bufs;
+
+	down_read(&fc->buffers_sem);
+	bufs = fc->buffers;
+	if (!bufs || index >= bufs->nr_bufs ||
+	    len > ((size_t)bufs->pages_per_buf << PAGE_SHIFT)) {
+		up_read(&fc->buffers_sem);
+		return -EINVAL;
 	}
 
+	IOV_ITER_BVEC(iter, dir, bufs->bvecs + index * bufs->pages_per_buf,
+		bufs->pages_per_buf, len);
 	return 0;
 }
-#endif
 
-static int fuse_notify_read_data(struct fuse_conn *conn, unsigned int size,
-				struct iov_iter *iter)
+void fuse_put_buffer(struct fuse_conn *fc)
 {
-	struct pxd_read_data_out read_data;
-	size_t len = sizeof(read_data);
+	up_read(&fc->buffers_sem);
+}
+
+static int fuse_notify_read_data_fixed(struct fuse_conn *conn,
+		unsigned int size, struct iov_iter *iter)
+{
+	struct pxd_fixed_data_out data;
+	size_t len = sizeof(data);
+	struct iov_iter data_iter, csum_iter;
+	struct fuse_csum cs, *csp = NULL;
 	struct fuse_req *req;
+	size_t skip;
+	int ret;
 
-	if (copy_from_iter(&read_data, len, iter) != len) {
-		printk(KERN_ERR "%s: can't copy read_data arg\n", __func__);
+	if (copy_from_iter(&data, len, iter) != len) {
+		printk(KERN_ERR "%s: can't copy fixed data arg\n", __func__);
 		return -EFAULT;
 	}
 
-	spin_lock(&conn->lock);
-	req = request_find(conn, read_data.unique);
-	if (!req) {
-		spin_unlock(&conn->lock);
-		printk(KERN_ERR "%s: request %lld not found\n", __func__,
-		       read_data.unique);
-		return -ENOENT;
+	req = fuse_find_write(conn, data.unique);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	/* unaligned data lands at its offset within the first block */
+	skip = req->pxd_rdwr_in.offset & PXD_LBS_MASK;
+	len = skip + req->pxd_rdwr_in.size;
+	if (req->pxd_rdwr_in.flags & PXD_FLAGS_CSUM)
+		len += PXD_CSUM_SIZE(req->pxd_rdwr_in.size);
+	ret = fuse_get_buffer(conn, data.buf_index, READ, len, &data_iter);
+	if (ret)
+		return ret;
+
+	iov_iter_advance(&data_iter, skip);
+	/* the block checksums follow the data */
+	if (req->pxd_rdwr_in.flags & PXD_FLAGS_CSUM) {
+		csum_iter = data_iter;
+		iov_iter_advance(&csum_iter, req->pxd_rdwr_in.size);
+		fuse_csum_init(&cs, &csum_iter);
+		csp = &cs;
 	}
-	spin_unlock(&conn->lock);
+	ret = fuse_copy_req_data(req, &data_iter, true, csp);
+	fuse_put_buffer(conn);
 
-	if (req->in.h.opcode != PXD_WRITE &&
-	    req->in.h.opcode != PXD_WRITE_SAME) {
-		printk(KERN_ERR "%s: request is not a write\n", __func__);
+	return ret;
+}
+
+/* Complete request @unique, read data is copied from buffer @index */
+static int fuse_reply_fixed(struct fuse_conn *fc, u64 unique, int res,
+		u32 index)
+{
+	struct fuse_out_header oh;
+	struct iov_iter data_iter;
+	struct fuse_req *req;
+	size_t len;
+	int ret;
+
+	if (res <= -1000 || res > 0)
 		return -EINVAL;
+
+	req = request_find(fc, unique);
+	if (!req)
+		return -ENOENT;
+
+	oh.error = res;
+	oh.unique = unique;
+
+	if (req->in.h.opcode != PXD_READ || res) {
+		/* no data, the buffer index is not used */
+		IOV_ITER_BVEC(&data_iter, WRITE, NULL, 0, 0);
+		oh.len = sizeof(oh);
+		return fuse_dev_reply(fc, &oh, &data_iter);
+	}
+
+	len = req->pxd_rdwr_in.size;
+	ret = fuse_get_buffer(fc, index, WRITE, len, &data_iter);
+	if (ret)
+		return ret;
+
+	oh.len = sizeof(oh) + len;
+	ret = fuse_dev_reply(fc, &oh, &data_iter);
+	fuse_put_buffer(fc);
+
+	return ret;
+}
+
+static int fuse_notify_reply_fixed(struct fuse_conn *conn, unsigned int size,
+		struct iov_iter *iter)
+{
+	struct pxd_fixed_data_out data;
+	size_t len = sizeof(data);
+
+	if (copy_from_iter(&data, len, iter) != len) {
+		printk(KERN_ERR "%s: can't copy fixed data arg\n", __func__);
+		return -EFAULT;
 	}
 
-	return __fuse_notify_read_data(conn, req, &read_data, iter);
+	return fuse_reply_fixed(conn, data.unique, data.res, data.buf_index);
+}
+#else
+int fuse_register_buffers(struct fuse_conn *fc, u64 addr, u64 len,
+		u32 buf_size)
+{
+	return -EOPNOTSUPP;
+}
+
+int fuse_get_buffer(struct fuse_conn *fc, u32 index, int dir, size_t len,
+		struct iov_iter *iter)
+{
+	return -EOPNOTSUPP;
+}
+
+void fuse_put_buffer(struct fuse_conn *fc)
+{
+}
+
+static int fuse_notify_read_data_fixed(struct fuse_conn *conn,
+		unsigned int size, struct iov_iter *iter)
+{
+	return -EOPNOTSUPP;
+}
+
+static int fuse_reply_fixed(struct fuse_conn *fc, u64 unique, int res,
+		u32 index)
+{
+	return -EOPNOTSUPP;
+}
+
+static int fuse_notify_reply_fixed(struct fuse_conn *conn, unsigned int size,
+		struct iov_iter *iter)
+{
+	return -EOPNOTSUPP;
 }
+#endif
 
 
 static int fuse_notify_remove(struct fuse_conn *conn, unsigned int size,
@@ -934,6 +2354,12 @@ static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 		return fuse_notify_ioswitch_event(fc, size, iter, false);
 	case PXD_EXPORT_DEV:
 		return fuse_notify_export(fc, size, iter);
+	case PXD_READ_DATA_FIXED:
+		return fuse_notify_read_data_fixed(fc, size, iter);
+	case PXD_REPLY_FIXED:
+		return fuse_notify_reply_fixed(fc, size, iter);
+	case PXD_READ_DATA_CSUM:
+		return fuse_notify_read_data_csum(fc, size, iter);
 	default:
 		return -EINVAL;
 	}
@@ -941,10 +2367,9 @@ static int fuse_notify(struct fuse_conn *fc, enum fuse_notify_code code,
 
 /*
  * Write a single reply to a request.  First the header is copied from
- * the write buffer.  The request is then searched on the processing
- * list by the unique ID found in the header.  If found, then remove
- * it from the list and copy the rest of the buffer to the request.
- * The request is finished by calling request_end()
+ * the write buffer.  The request is then looked up by the unique ID found
+ * in the header.  If found and claimed, the rest of the buffer is copied
+ * to the request.  The request is finished by calling request_end()
  */
 #ifndef __PXD_BIO_MAKEREQ__
 static int __fuse_dev_do_write(struct fuse_conn *fc,
@@ -975,7 +2400,7 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 			}
 		}
 	}
-	request_end(fc, req, true);
+	request_end(fc, req);
 	return 0;
 }
 #else
@@ -1010,15 +2435,51 @@ static int __fuse_dev_do_write(struct fuse_conn *fc,
 			}
 		}
 	}
-	request_end(fc, req, true);
+	request_end(fc, req);
 	return 0;
 }
 #endif
 
+/* Complete request @oh->unique, read data is copied from @iter */
+static int fuse_dev_reply(struct fuse_conn *fc, struct fuse_out_header *oh,
+		struct iov_iter *iter)
+{
+	struct fuse_req *req;
+	bool claimed;
+	int ret;
+
+	rcu_read_lock();
+	req = request_find(fc, oh->unique);
+	if (req)
+		fuse_req_wait_idle(req);
+	/* lost to an abort, a restart or another reply */
+	claimed = req && READ_ONCE(fc->connected) &&
+		fuse_req_claim(req, oh->unique);
+	rcu_read_unlock();
+	if (!req) {
+		printk(KERN_ERR "%s: request %lld not found\n", __func__, oh->unique);
+		return -ENOENT;
+	}
+	if (!claimed)
+		return -ENOENT;
+
+	req->out.h = *oh;
+
+	/*
+	 * A request put back in flight could be missed by an abort which ran
+	 * meanwhile, a reply which fails to copy fails the request instead.
+	 */
+	ret = __fuse_dev_do_write(fc, req, iter);
+	if (ret) {
+		req->out.h.error = -EIO;
+		request_end(fc, req);
+	}
+	return ret;
+}
+
 static ssize_t fuse_dev_do_write(struct fuse_conn *fc, struct iov_iter *iter)
 {
 	int err;
-	struct fuse_req *req;
 	struct fuse_out_header oh;
 	size_t len;
 	size_t nbytes = iter->count;
@@ -1047,29 +2508,162 @@ static ssize_t fuse_dev_do_write(struct fuse_conn *fc, struct iov_iter *iter)
 	if (oh.error <= -1000 || oh.error > 0)
 		return -EINVAL;
 
-	err = -ENOENT;
+	err = fuse_dev_reply(fc, &oh, iter);
+	if (err) return err;
 
-	req = request_find(fc, oh.unique);
-	if (!req) {
-		printk(KERN_ERR "%s: request %lld not found\n", __func__, oh.unique);
-		return -ENOENT;
+	return nbytes;
+}
+
+/*
+ * Let user space know that one of its requests failed by posting a
+ * PXD_COMPLETE entry on the request queue.
+ */
+static void fuse_queue_complete(struct fuse_conn *fc,
+		struct fuse_user_request *ureq, int res)
+{
+	struct rdwr_in *entry;
+
+	spin_lock(&fc->queue_lock);
+	entry = fuse_queue_reserve(fc);
+	if (entry) {
+		memset(entry, 0, sizeof(*entry));
+		entry->in.len = sizeof(*entry);
+		entry->in.opcode = PXD_COMPLETE;
+		entry->in.unique = ureq->unique;
+		entry->completion.user_data = ureq->user_data;
+		entry->completion.res = res;
+		fuse_queue_commit(fc);
 	}
+	spin_unlock(&fc->queue_lock);
 
-	spin_lock(&fc->lock);
-	if (!fc->connected) {
-		spin_unlock(&fc->lock);
-		return err;
+	fuse_queue_wakeup(fc);
+}
+
+static int fuse_process_user_request(struct fuse_conn *fc,
+		struct fuse_user_request *ureq)
+{
+	struct iovec iov[IOV_BUF_SIZE];
+	struct iov_iter iter;
+	struct fuse_out_header oh;
+	size_t len;
+
+	switch (ureq->opcode) {
+	case FUSE_USER_OP_NOP:
+		return 0;
+	case FUSE_USER_OP_REQ_DONE:
+		break;
+	case FUSE_USER_OP_REQ_DONE_FIXED:
+		return fuse_reply_fixed(fc, ureq->unique, ureq->res,
+			ureq->buf_index);
+	default:
+		return -EINVAL;
 	}
 
-	list_del_init(&req->list);
-	spin_unlock(&fc->lock);
+	if (ureq->res <= -1000 || ureq->res > 0)
+		return -EINVAL;
+
+	if (ureq->len > IOV_BUF_SIZE)
+		return -EINVAL;
 
-	req->out.h = oh;
+	len = ureq->len * sizeof(struct iovec);
+	if (len && copy_from_user(iov,
+			(void __user *)(uintptr_t)ureq->iov_addr, len))
+		return -EFAULT;
 
-	err = __fuse_dev_do_write(fc, req, iter);
-	if (err) return err;
+	iov_iter_init(&iter, WRITE, iov, ureq->len, iov_length(iov, ureq->len));
 
-	return nbytes;
+	oh.len = sizeof(oh) + iter.count;
+	oh.error = ureq->res;
+	oh.unique = ureq->unique;
+
+	return fuse_dev_reply(fc, &oh, &iter);
+}
+
+/* Lockless check for entries on the user request queue */
+static bool fuse_user_queue_pending(struct fuse_conn *fc)
+{
+	struct fuse_queue_cb *cb;
+
+	/* the user request queue is in use once the queues are mapped */
+	if (!READ_ONCE(fc->queue_mode))
+		return false;
+
+	cb = &fc->queue->user_requests_cb;
+	return READ_ONCE(fc->user_queue_read) !=
+		(READ_ONCE(cb->r.write) & (FUSE_REQUEST_QUEUE_SIZE - 1));
+}
+
+/* Called with fc->user_queue_lock held */
+static int __fuse_run_user_queue(struct fuse_conn *fc, u32 max)
+{
+	struct fuse_queue_cb *cb = &fc->queue->user_requests_cb;
+	struct fuse_user_request ureq;
+	u32 read, write;
+	int count = 0;
+	int err;
+
+	read = fc->user_queue_read;
+	/* pairs with the release of the write index by user space */
+	write = smp_load_acquire(&cb->r.write) & (FUSE_REQUEST_QUEUE_SIZE - 1);
+	while (read != write && (!max || count < max)) {
+		/* user space owns the entry, work on a private copy */
+		ureq = fc->queue->user_requests[read];
+		read = (read + 1) & (FUSE_REQUEST_QUEUE_SIZE - 1);
+
+		err = fuse_process_user_request(fc, &ureq);
+		if (unlikely(err)) {
+			printk_ratelimited(KERN_ERR "%s: request %llx op %d failed: %d\n",
+				__func__, ureq.unique, ureq.opcode, err);
+			fuse_queue_complete(fc, &ureq, err);
+		}
+		++count;
+
+		if (read == write)
+			write = smp_load_acquire(&cb->r.write) &
+				(FUSE_REQUEST_QUEUE_SIZE - 1);
+	}
+	WRITE_ONCE(fc->user_queue_read, read);
+	smp_store_release(&cb->r.read, read);
+
+	return count;
+}
+
+int fuse_run_user_queue(struct fuse_conn *fc, u32 max)
+{
+	int count;
+
+	if (!fuse_user_queue_pending(fc))
+		return 0;
+
+	mutex_lock(&fc->user_queue_lock);
+	count = __fuse_run_user_queue(fc, max);
+	mutex_unlock(&fc->user_queue_lock);
+
+	return count;
+}
+
+/*
+ * Complete the user requests on the way into a read, in batches so the
+ * lock is not held across the whole queue. Readers do not wait for each
+ * other here, whoever holds the lock is draining the queue already.
+ * Returns the number of user requests completed.
+ */
+static int fuse_try_run_user_queue(struct fuse_conn *fc)
+{
+	int count, total = 0;
+
+	while (fuse_user_queue_pending(fc)) {
+		if (!mutex_trylock(&fc->user_queue_lock))
+			break;
+		count = __fuse_run_user_queue(fc, FUSE_USER_QUEUE_BATCH);
+		mutex_unlock(&fc->user_queue_lock);
+		total += count;
+		if (count < FUSE_USER_QUEUE_BATCH)
+			break;
+		cond_resched();
+	}
+
+	return total;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,0,0)
@@ -1096,6 +2690,12 @@ static ssize_t fuse_dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
 }
 #endif
 
+/*
+ * Replies are not taken through splice. Read data is copied into the bio
+ * either way, the pipe pages cannot replace pages of the submitter, so a
+ * splice saves no copy over write. A reply spread over more than one pipe
+ * flush would reach us as several writes and lose its header.
+ */
 static ssize_t fuse_dev_splice_write(struct pipe_inode_info *pipe,
 				     struct file *out, loff_t *ppos,
 				     size_t len, unsigned int flags)
@@ -1112,95 +2712,314 @@ static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &fc->waitq, wait);
 
-	spin_lock(&fc->lock);
-	if (!fc->connected)
+	/* user requests are completed by the read which follows */
+	if (!READ_ONCE(fc->connected))
 		mask = POLLERR;
-	else if (request_pending(fc))
+	else if (request_pending(fc) || fuse_queue_pending(fc) ||
+		 fuse_user_queue_pending(fc))
 		mask |= POLLIN | POLLRDNORM;
-	spin_unlock(&fc->lock);
 
 	return mask;
 }
 
+static void fuse_queue_vm_open(struct vm_area_struct *vma)
+{
+	struct fuse_conn *fc = vma->vm_private_data;
+
+	mutex_lock(&fc->queue_map_lock);
+	fc->queue_maps++;
+	mutex_unlock(&fc->queue_map_lock);
+}
+
+static void fuse_queue_vm_close(struct vm_area_struct *vma)
+{
+	struct fuse_conn *fc = vma->vm_private_data;
+
+	mutex_lock(&fc->queue_map_lock);
+	if (--fc->queue_maps == 0)
+		fuse_queue_disable(fc);
+	mutex_unlock(&fc->queue_map_lock);
+}
+
+static const struct vm_operations_struct fuse_queue_vm_ops = {
+	.open	= fuse_queue_vm_open,
+	.close	= fuse_queue_vm_close,
+};
+
 /*
- * Abort all requests on the given list (pending or processing)
- *
- * This function releases and reacquires fc->lock
+ * Map the shared queues of the connection, see struct fuse_conn_queues.
+ * The queues are allocated by the first mmap. While mapped, new requests
+ * are published on the request queue instead of the pending list.
  */
+static int fuse_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct fuse_conn *fc = fuse_get_conn(file);
+	int rc;
+
+	if (!fc)
+		return -EPERM;
+
+	if (vma->vm_pgoff != 0)
+		return -EINVAL;
+
+	mutex_lock(&fc->queue_map_lock);
+	if (!fc->queue) {
+		fc->queue = vmalloc_user(sizeof(struct fuse_conn_queues));
+		if (!fc->queue) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	rc = remap_vmalloc_range(vma, fc->queue, 0);
+	if (rc) {
+		printk(KERN_ERR "%s: map queues failed: %d\n", __func__, rc);
+		goto out;
+	}
+
+	vma->vm_private_data = fc;
+	vma->vm_ops = &fuse_queue_vm_ops;
+	fc->queue_maps++;
+	fuse_queue_enable(fc);
+out:
+	mutex_unlock(&fc->queue_map_lock);
+	return rc;
+}
+
+/* Abort the claimed requests on @head */
 static void end_requests(struct fuse_conn *fc, struct list_head *head)
-__releases(fc->lock)
-__acquires(fc->lock)
 {
-	while (!list_empty(head)) {
-		struct fuse_req *req;
-		req = list_entry(head->next, struct fuse_req, list);
+	struct fuse_req *req, *next;
+
+	list_for_each_entry_safe(req, next, head, list) {
+		list_del(&req->list);
 		req->out.h.error = -ECONNABORTED;
-		request_end(fc, req, false);
-		spin_lock(&fc->lock);
+		request_end(fc, req);
 	}
 }
 
+/* Abort the queued requests, then the ones user space has */
 void fuse_end_queued_requests(struct fuse_conn *fc)
 __releases(fc->lock)
 __acquires(fc->lock)
 {
-	end_requests(fc, &fc->pending);
-	end_requests(fc, &fc->processing);
+	struct fuse_pqueue *pq;
+	struct fuse_req *req;
+	LIST_HEAD(head);
+	u32 i;
+
+	fuse_queue_reset(fc);
+	spin_unlock(&fc->lock);
+	for (i = 0; i < fc->nr_queues; ++i) {
+		pq = &fc->queues[i];
+		spin_lock(&pq->lock);
+		fuse_pqueue_drain(pq, &head);
+		list_for_each_entry(req, &head, list)
+			atomic64_set(&req->inflight, 0);
+		spin_unlock(&pq->lock);
+		end_requests(fc, &head);
+		INIT_LIST_HEAD(&head);
+	}
+
+	/*
+	 * Orders clearing fc->connected against the scan, readers which
+	 * mark a request sent after the scan passed it see the abort.
+	 */
+	smp_mb();
+	for (i = 0; i < FUSE_MAX_REQUEST_IDS; ++i) {
+		rcu_read_lock();
+		req = READ_ONCE(*fuse_request_slot(fc, i));
+		if (req)
+			fuse_req_wait_idle(req);
+		if (req && fuse_req_claim(req, READ_ONCE(req->in.h.unique))) {
+			rcu_read_unlock();
+			req->out.h.error = -ECONNABORTED;
+			request_end(fc, req);
+			continue;
+		}
+		rcu_read_unlock();
+	}
+	spin_lock(&fc->lock);
 }
 
 static void fuse_conn_free_allocs(struct fuse_conn *fc)
 {
+	u32 i;
+
+	if (fc->buffers)
+		fuse_unregister_buffers(fc);
+	if (fc->queue)
+		vfree(fc->queue);
 	if (fc->per_cpu_ids)
 		free_percpu(fc->per_cpu_ids);
-	if (fc->free_ids)
-		kfree(fc->free_ids);
-	if (fc->request_map)
+	if (fc->id_mags) {
+		for (i = 0; i < fc->nr_id_mags; ++i)
+			kfree(fc->id_mags[i]);
+		kfree(fc->id_mags);
+	}
+	if (fc->id_depots)
+		kfree(fc->id_depots);
+	if (fc->request_map) {
+		for (i = 0; i < fc->nr_map_shards; ++i)
+			vfree(fc->request_map[i]);
 		kfree(fc->request_map);
+	}
+	if (fc->queues) {
+		for (i = 0; i < fc->nr_queues; ++i)
+			fuse_pqueue_free_flows(&fc->queues[i]);
+		kfree(fc->queues);
+	}
+	if (fc->node_waitq)
+		kfree(fc->node_waitq);
+}
+
+/* Memory on @node if it has any, else wherever the allocator likes */
+static int fuse_alloc_node(int node)
+{
+	return node_online(node) ? node : NUMA_NO_NODE;
+}
+
+/*
+ * The request map is split into a shard per node, the ids of a shard seed
+ * the depot of its node so requests submitted there find their slot in
+ * local memory. Magazines wander to the nodes completing requests and are
+ * taken back in whole, ids only cross nodes id_mag_size at a time.
+ *
+ * The cpus hold up to two magazines each, those ids are stranded for the
+ * other cpus. Magazines shrink on machines with many cpus so stranded ids
+ * take no more than a quarter of them, half are enough for all requests
+ * the devices may have in flight.
+ */
+static int fuse_conn_init_ids(struct fuse_conn *fc)
+{
+	u32 shard_ids, nr_full, i, j;
+	struct fuse_id_mag *mag;
+	int node, cpu;
+
+	fc->id_mag_size = min_t(u32, FUSE_ID_MAG_SIZE,
+		FUSE_MAX_REQUEST_IDS / 4 / (2 * nr_cpu_ids));
+	fc->id_mag_size = rounddown_pow_of_two(max(fc->id_mag_size, 1U));
+
+	fc->nr_map_shards = roundup_pow_of_two(nr_node_ids);
+	shard_ids = FUSE_MAX_REQUEST_IDS / fc->nr_map_shards;
+	fc->map_shift = ilog2(shard_ids);
+
+	fc->request_map = kcalloc(fc->nr_map_shards,
+		sizeof(*fc->request_map), GFP_KERNEL);
+	if (!fc->request_map)
+		return -ENOMEM;
+	for (i = 0; i < fc->nr_map_shards; ++i) {
+		node = fuse_alloc_node(i % nr_node_ids);
+		fc->request_map[i] = vzalloc_node(shard_ids *
+			sizeof(struct fuse_req *), node);
+		if (!fc->request_map[i])
+			return -ENOMEM;
+	}
+
+	fc->id_depots = kcalloc(nr_node_ids, sizeof(struct fuse_id_depot),
+		GFP_KERNEL);
+	if (!fc->id_depots)
+		return -ENOMEM;
+	for (i = 0; i < nr_node_ids; ++i) {
+		atomic64_set(&fc->id_depots[i].full, FUSE_ID_MAG_NONE);
+		atomic64_set(&fc->id_depots[i].empty, FUSE_ID_MAG_NONE);
+	}
+
+	/* two magazines loaded per cpu and a spare for one in transit */
+	nr_full = FUSE_MAX_REQUEST_IDS / fc->id_mag_size;
+	fc->nr_id_mags = nr_full + 3 * nr_cpu_ids;
+	fc->id_mags = kcalloc(fc->nr_id_mags, sizeof(struct fuse_id_mag *),
+		GFP_KERNEL);
+	if (!fc->id_mags)
+		return -ENOMEM;
+	for (i = 0; i < fc->nr_id_mags; ++i) {
+		if (i < nr_full) {
+			node = ((i * fc->id_mag_size) >> fc->map_shift) %
+				nr_node_ids;
+		} else {
+			cpu = (i - nr_full) % nr_cpu_ids;
+			node = cpu_possible(cpu) ? cpu_to_node(cpu) : 0;
+		}
+		mag = kmalloc_node(sizeof(*mag) +
+			fc->id_mag_size * sizeof(mag->ids[0]), GFP_KERNEL,
+			fuse_alloc_node(node));
+		if (!mag)
+			return -ENOMEM;
+		fc->id_mags[i] = mag;
+		mag->index = i;
+		mag->count = 0;
+		if (i < nr_full) {
+			/* lowest ids are handed out first */
+			for (j = 0; j < fc->id_mag_size; ++j)
+				mag->ids[j] = (i + 1) * fc->id_mag_size - j - 1;
+			mag->count = fc->id_mag_size;
+			fuse_id_push(&fc->id_depots[node].full, mag);
+		} else {
+			fuse_id_push(&fc->id_depots[node].empty, mag);
+		}
+	}
+
+	fc->per_cpu_ids = alloc_percpu(struct fuse_per_cpu_ids);
+	if (!fc->per_cpu_ids)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct fuse_per_cpu_ids *my_ids = per_cpu_ptr(fc->per_cpu_ids, cpu);
+		my_ids->loaded = fuse_id_depot_get(fc, cpu_to_node(cpu), false);
+		my_ids->prev = fuse_id_depot_get(fc, cpu_to_node(cpu), false);
+	}
+
+	return 0;
 }
 
 int fuse_conn_init(struct fuse_conn *fc)
 {
-	int i, rc;
-	int cpu;
+	int i, j, rc;
 
 	memset(fc, 0, sizeof(*fc));
 	spin_lock_init(&fc->lock);
 	atomic_set(&fc->count, 1);
 	init_waitqueue_head(&fc->waitq);
-	INIT_LIST_HEAD(&fc->pending);
-	INIT_LIST_HEAD(&fc->processing);
 	INIT_LIST_HEAD(&fc->entry);
-	fc->request_map = kmalloc(FUSE_MAX_REQUEST_IDS * sizeof(struct fuse_req*),
-		GFP_KERNEL);
+	mutex_init(&fc->user_queue_lock);
+	mutex_init(&fc->queue_map_lock);
+	spin_lock_init(&fc->queue_lock);
+	init_rwsem(&fc->buffers_sem);
 
 	rc = -ENOMEM;
-	if (!fc->request_map) {
-		printk(KERN_ERR "failed to allocate request map");
+	fc->nr_queues = nr_cpu_ids;
+	fc->queues = kcalloc(fc->nr_queues, sizeof(struct fuse_pqueue),
+		GFP_KERNEL);
+	if (!fc->queues) {
+		printk(KERN_ERR "failed to allocate request queues");
 		goto err_out;
 	}
-	memset(fc->request_map, 0,
-		FUSE_MAX_REQUEST_IDS * sizeof(struct fuse_req*));
+	for (i = 0; i < fc->nr_queues; ++i) {
+		init_llist_head(&fc->queues[i].submit);
+		fc->queues[i].node = cpu_possible(i) ? cpu_to_node(i) : 0;
+		spin_lock_init(&fc->queues[i].lock);
+		INIT_LIST_HEAD(&fc->queues[i].urgent);
+		INIT_LIST_HEAD(&fc->queues[i].active);
+		for (j = 0; j < FUSE_PQUEUE_FLOWS; ++j)
+			INIT_HLIST_HEAD(&fc->queues[i].flows[j]);
+		INIT_LIST_HEAD(&fc->queues[i].fallback.pending);
+		INIT_LIST_HEAD(&fc->queues[i].fallback.active);
+	}
 
-	fc->free_ids = kmalloc(FUSE_MAX_REQUEST_IDS * sizeof(u64), GFP_KERNEL);
-	if (!fc->free_ids) {
-		printk(KERN_ERR "failed to allocate free requests");
+	fc->node_waitq = kcalloc(nr_node_ids, sizeof(wait_queue_head_t),
+		GFP_KERNEL);
+	if (!fc->node_waitq) {
+		printk(KERN_ERR "failed to allocate node wait queues");
 		goto err_out;
 	}
-	for (i = 0; i < FUSE_MAX_REQUEST_IDS; ++i) {
-		fc->free_ids[i] = FUSE_MAX_REQUEST_IDS - i - 1;
-	}
-	fc->num_free_ids = FUSE_MAX_REQUEST_IDS;
+	for (i = 0; i < nr_node_ids; ++i)
+		init_waitqueue_head(&fc->node_waitq[i]);
 
-	fc->per_cpu_ids = alloc_percpu(struct fuse_per_cpu_ids);
-	if (!fc->per_cpu_ids) {
-		printk(KERN_ERR "failed to allocate per cpu ids");
+	if (fuse_conn_init_ids(fc)) {
+		printk(KERN_ERR "failed to allocate request ids");
 		goto err_out;
 	}
 
-	for_each_possible_cpu(cpu) {
-		struct fuse_per_cpu_ids *my_ids = per_cpu_ptr(fc->per_cpu_ids, cpu);
-		memset(my_ids, 0, sizeof(*my_ids));
-	}
 
 	fc->reqctr = 0;
 	return 0;
@@ -1244,11 +3063,15 @@ struct fuse_conn *fuse_conn_get(struct fuse_conn *fc)
  */
 void fuse_abort_conn(struct fuse_conn *fc)
 {
+	int i;
+
 	spin_lock(&fc->lock);
 	if (fc->connected) {
 		fc->connected = 0;
 		fuse_end_queued_requests(fc);
 		wake_up_all(&fc->waitq);
+		for (i = 0; i < nr_node_ids; ++i)
+			wake_up_all(&fc->node_waitq[i]);
 		kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 	}
 	spin_unlock(&fc->lock);
@@ -1268,13 +3091,45 @@ static int fuse_dev_release(struct inode *inode, struct file *file)
 	return 0;
 }
 
+/*
+ * Queue the requests user space has again, ahead of the requests not yet
+ * read. They were all in flight at once, their order does not matter.
+ * The request map is scanned without fc->lock, requests are requeued
+ * under the lock of their queue only.
+ */
 void fuse_restart_requests(struct fuse_conn *fc)
 {
+	struct fuse_pqueue *pq;
+	struct fuse_req *req;
+	u64 uid;
+	u32 i;
+
 	spin_lock(&fc->lock);
-	list_splice_init(&fc->processing, &fc->pending);
-	wake_up(&fc->waitq);
-	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+	fuse_queue_reset(fc);
 	spin_unlock(&fc->lock);
+
+	for (i = 0; i < FUSE_MAX_REQUEST_IDS; ++i) {
+		rcu_read_lock();
+		req = READ_ONCE(*fuse_request_slot(fc, i));
+		if (!req) {
+			rcu_read_unlock();
+			continue;
+		}
+
+		/* a request being read out is sent once the reader is done */
+		fuse_req_wait_idle(req);
+		uid = READ_ONCE(req->in.h.unique);
+		pq = fuse_req_queue(fc, req);
+		spin_lock(&pq->lock);
+		if (atomic64_cmpxchg(&req->inflight, uid, FUSE_REQ_PENDING) == uid)
+			fuse_pqueue_add(pq, req, true);
+		spin_unlock(&pq->lock);
+		rcu_read_unlock();
+
+		if (!(i % 1024))
+			cond_resched();
+	}
+	fuse_conn_wakeup(fc);
 }
 
 static int fuse_dev_fasync(int fd, struct file *file, int on)
@@ -1299,6 +3154,7 @@ const struct file_operations fuse_dev_operations = {
 	.aio_write	= fuse_dev_write,
 	.splice_write	= fuse_dev_splice_write,
 	.poll		= fuse_dev_poll,
+	.mmap		= fuse_dev_mmap,
 	.release	= fuse_dev_release,
 	.fasync		= fuse_dev_fasync,
 };
@@ -1311,6 +3167,7 @@ const struct file_operations fuse_dev_operations = {
 	.write_iter	= fuse_dev_write_iter,
 	.splice_write	= fuse_dev_splice_write,
 	.poll		= fuse_dev_poll,
+	.mmap		= fuse_dev_mmap,
 	.release	= fuse_dev_release,
 	.fasync		= fuse_dev_fasync,
 };
@@ -1323,11 +3180,12 @@ int fuse_dev_init(void)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,16,0)
 	fuse_req_cachep = kmem_cache_create_usercopy("pxd_fuse_request",
 					    sizeof(struct fuse_req),
-					    0, 0, 0, sizeof(struct fuse_req), NULL);
+					    0, FUSE_REQ_CACHE_FLAGS, 0,
+					    sizeof(struct fuse_req), NULL);
 #else
 	fuse_req_cachep = kmem_cache_create("pxd_fuse_request",
 					    sizeof(struct fuse_req),
-					    0, 0, NULL);
+					    0, FUSE_REQ_CACHE_FLAGS, NULL);
 #endif
 	if (!fuse_req_cachep)
 		goto out;
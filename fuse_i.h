@@ -14,6 +14,7 @@
 #include <linux/mount.h>
 #include <linux/wait.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/spinlock.h>
 #include <linux/mm.h>
 #include <linux/backing-dev.h>
@@ -75,10 +76,12 @@ struct fuse_out {
  * A request to the client
  */
 struct fuse_req {
-	/** This can be on either pending processing or io lists in
-	    fuse_conn */
+	/** Entry on a pending list of a queue while the request waits */
 	struct list_head list;
 
+	/** Entry on the lockless submit list of a pending queue */
+	struct llist_node llnode;
+
 	/** Need to fetch state of device */
 	struct pxd_device *pxd_dev;
 
@@ -90,6 +93,9 @@ struct fuse_req {
 
 	struct pxd_rdwr_in pxd_rdwr_in;
 
+	/** Zero blocks of a write, see PXD_FLAGS_ZERO_MAP */
+	uint64_t zero_map[PXD_ZERO_MAP_WORDS];
+
 	union {
 		/** Associated request structrure. */
 		struct request *rq;
@@ -103,6 +109,23 @@ struct fuse_req {
 
 	/** Associate request queue */
 	struct request_queue *queue;
+
+	/**
+	 * Id of the request while user space has it, FUSE_REQ_PENDING while
+	 * it waits on a queue, FUSE_REQ_READING while a reader copies it out,
+	 * FUSE_REQ_HELD while io ring I/O uses its pages, 0 once it is
+	 * claimed for completion
+	 */
+	atomic64_t inflight;
+
+	/** Index of the pending queue the request was submitted to */
+	u32 qid;
+
+	/** Dispatch class, see enum fuse_req_prio */
+	u32 prio;
+
+	/** Flow of a pending bulk request */
+	struct fuse_flow *flow;
 #if defined __PXD_BIO_BLKMQ__ && defined __PX_FASTPATH__
 	// Additional fastpath context
 	struct fp_root_context fproot;
@@ -134,14 +157,48 @@ struct fuse_req* fproot_to_fuse_request(struct fp_root_context *fproot)
 
 #endif
 
-#define FUSE_MAX_PER_CPU_IDS 256
+/**
+ * Most request ids moved between a cpu and a depot at once, fewer on
+ * machines with many cpus, see fuse_conn::id_mag_size
+ */
+#define FUSE_ID_MAG_SIZE 128
 
-struct ____cacheline_aligned fuse_per_cpu_ids {
-	/** number of free ids in stack */
-	u32 num_free_ids;
+/** Marks the end of a depot stack */
+#define FUSE_ID_MAG_NONE U32_MAX
+
+/** A magazine of free request ids */
+struct fuse_id_mag {
+	/** index of this magazine in fuse_conn::id_mags */
+	u32 index;
 
-	/** followed by list of free ids */
-	u64 free_ids[FUSE_MAX_PER_CPU_IDS];
+	/** index of the magazine below on a depot stack */
+	u32 next;
+
+	/** number of ids held */
+	u32 count;
+
+	/** fuse_conn::id_mag_size entries */
+	u64 ids[];
+};
+
+/**
+ * Full and empty magazines of a NUMA node. Each stack is the index of its
+ * top magazine in the low 32 bits and a generation in the high 32 bits,
+ * so pops racing with pops and pushes of the same magazine fail cmpxchg.
+ */
+struct ____cacheline_aligned fuse_id_depot {
+	atomic64_t full;
+	atomic64_t empty;
+};
+
+/**
+ * Magazines loaded on a cpu. Ids are taken from and returned to @loaded,
+ * @prev is either full or empty and is swapped in before the depot is
+ * visited, so a cpu alternating around a magazine boundary stays local.
+ */
+struct ____cacheline_aligned fuse_per_cpu_ids {
+	struct fuse_id_mag *loaded;
+	struct fuse_id_mag *prev;
 };
 #endif
 
@@ -158,9 +215,9 @@ struct ____cacheline_aligned fuse_per_cpu_ids {
 #ifdef __KERNEL__
 /** writer control block */
 struct ____cacheline_aligned fuse_queue_writer {
-	uint32_t write;         /** cached write index */
-	uint32_t read;		/** cached read index */
-	spinlock_t lock;	/** writer lock */
+	uint32_t write;         /** cached write index, user space only */
+	uint32_t read;		/** cached read index, user space only */
+	uint32_t lock;		/** writer lock of user space */
 	uint32_t pad_0;
 	uint64_t sequence;        /** next request sequence number */
 	uint64_t pad[5];
@@ -205,11 +262,18 @@ struct alignas(64) fuse_queue_reader {
 /** opcodes for fuse_user_request */
 #define FUSE_USER_OP_NOP 0		/** nop */
 #define FUSE_USER_OP_REQ_DONE 1		/** request completion */
+#define FUSE_USER_OP_REQ_DONE_FIXED 2	/** completion, data in registered buffer buf_index */
+
+/** Registered buffers FUSE_USER_OP_REQ_DONE_FIXED can refer to */
+#define FUSE_USER_MAX_BUFFERS (1U << 16)
 
 /** request from user space to kernel */
 struct fuse_user_request {
 	uint8_t opcode;		/** operation code */
-	uint16_t len;		/** number of entries in iovec array */
+	union {
+		uint16_t len;	/** number of entries in iovec array, REQ_DONE */
+		uint16_t buf_index; /** registered buffer, REQ_DONE_FIXED */
+	};
 	uint8_t pad;		/** padding */
 	int32_t res;		/** result code */
 	uint64_t unique;	/** unique id of request */
@@ -223,7 +287,23 @@ struct fuse_queue_cb {
 	struct fuse_queue_reader r;
 };
 
-/** fuse connection queues */
+/**
+ * fuse connection queues
+ *
+ * Allocated and mapped by user space at offset 0 of the control device.
+ * While mapped, the kernel publishes new requests on the requests queue
+ * instead of the pending list, the last unmap moves requests not yet read
+ * back to the pending list. The reader sets need_wake_up before it goes to
+ * sleep in poll and rechecks the write index, the kernel only wakes it up
+ * then. The kernel keeps its own cursors, see fuse_conn::queue_write.
+ *
+ * Completions posted by user space on the user requests queue are
+ * drained in batches by reads, poll reports POLLIN while any are queued
+ * so a reader comes to drain them. A read which completed some, or finds
+ * requests on the requests queue, returns 0. Requests which fail are
+ * answered with a PXD_COMPLETE entry on the requests queue carrying
+ * user_data and the error.
+ */
 struct ____cacheline_aligned fuse_conn_queues {
 	/** requests from kernel to user space */
 	struct fuse_queue_cb requests_cb;
@@ -235,6 +315,106 @@ struct ____cacheline_aligned fuse_conn_queues {
 };
 
 #ifdef __KERNEL__
+/** Dispatch classes of requests on the pending queues */
+enum fuse_req_prio {
+	FUSE_PRIO_URGENT,	/**< flushes, FUA and metadata writes, control */
+	FUSE_PRIO_BULK,		/**< other reads and writes */
+	FUSE_PRIO_MAX,
+};
+
+/** Buckets of the flow hash of a queue, flows are keyed by device minor */
+#define FUSE_PQUEUE_FLOW_BITS	6
+#define FUSE_PQUEUE_FLOWS	(1U << FUSE_PQUEUE_FLOW_BITS)
+
+/** Bytes a flow may dispatch per round */
+#define FUSE_FLOW_QUANTUM	(128 * 1024)
+
+/**
+ * Bulk requests of a device on a queue. Flows are allocated the first time
+ * a device queues bulk requests on a queue and kept until the connection
+ * goes away, minors are reused so there are no more than the most devices
+ * which existed at once.
+ */
+struct fuse_flow {
+	/** Entry on the flow hash of the queue */
+	struct hlist_node hash;
+
+	/** Device minor of the requests */
+	u32 minor;
+
+	/** Pending requests of the flow */
+	struct list_head pending;
+
+	/** Entry on the active flows of the queue while requests are pending */
+	struct list_head active;
+
+	/** Bytes the flow may still dispatch in the current round */
+	s32 deficit;
+};
+
+/**
+ * A pending request queue, one per CPU. Submitters add to the queue of
+ * their CPU, readers start with their own queue and steal from the others.
+ * New requests are pushed on the submit list without taking the lock and
+ * moved to the pending lists by whoever takes the lock next. Bulk requests
+ * are dispatched round robin over the flows of the devices, so a device
+ * with a deep queue does not starve the others.
+ */
+struct ____cacheline_aligned fuse_pqueue {
+	/** Lockless list of newly submitted requests, newest first */
+	struct llist_head submit;
+
+	/** NUMA node of the CPU the queue belongs to */
+	int node;
+
+	/** Lock protecting the lists of this queue */
+	spinlock_t lock;
+
+	/** Pending urgent requests */
+	struct list_head urgent;
+
+	/** Flows with pending bulk requests, in round robin order */
+	struct list_head active;
+
+	/** Flows of the devices which queued bulk requests here */
+	struct hlist_head flows[FUSE_PQUEUE_FLOWS];
+
+	/** Shared by the devices whose flow could not be allocated */
+	struct fuse_flow fallback;
+
+	/** Urgent requests dispatched since the last bulk one */
+	u32 urgent_run;
+
+	/** Requests dispatched per class */
+	u64 dispatched[FUSE_PRIO_MAX];
+
+	/** Bulk requests dispatched ahead of waiting urgent ones */
+	u64 promoted;
+};
+
+/** maximum size of the registered buffer arena */
+#define FUSE_MAX_BUFFERS_SIZE (1ULL << 30)
+
+/**
+ * User memory pinned by PXD_IOC_REGISTER_BUFFERS, split into buffers of
+ * pages_per_buf pages each.
+ */
+struct fuse_buffers {
+	/** pinned pages of the arena */
+	struct page **pages;
+
+	/** one bio_vec per page, buffers are slices of this array */
+	struct bio_vec *bvecs;
+
+	u32 nr_pages;
+	u32 pages_per_buf;
+	u32 nr_bufs;
+
+	/** mm whose pinned_vm nr_charged pages are charged to */
+	struct mm_struct *mm;
+	u32 nr_charged;
+};
+
 /**
  * A Fuse connection.
  *
@@ -246,23 +426,38 @@ struct fuse_conn {
 	/** Lock protecting accessess to  members of this structure */
 	spinlock_t lock;
 
-	/** Readers of the connection are waiting on this */
+	/** Pollers and queue mode readers of the connection wait on this */
 	wait_queue_head_t waitq;
 
-	/** The list of pending requests */
-	struct list_head pending;
+	/** Readers wait on the queue of their NUMA node */
+	wait_queue_head_t *node_waitq;
+
+	/** Pending request queues */
+	struct fuse_pqueue *queues;
+
+	/** Number of pending request queues */
+	u32 nr_queues;
 
-	/** The list of requests being processed */
-	struct list_head processing;
+	/** Rotates the first queue looked at by readers not bound to one */
+	atomic_t next_queue;
 
-	/** maps request ids to requests */
-	struct fuse_req **request_map;
+	/**
+	 * maps request ids to requests, in shards of 1 << map_shift ids
+	 * allocated on the node whose depot is seeded with them
+	 */
+	struct fuse_req ***request_map;
+	u32 map_shift;
+	u32 nr_map_shards;
 
-	/** stack of free ids */
-	u64 *free_ids;
+	/** all id magazines, depot stacks refer to them by index */
+	struct fuse_id_mag **id_mags;
+	u32 nr_id_mags;
 
-	/** number of free ids in stack */
-	u32 num_free_ids;
+	/** ids a magazine holds, a power of two up to FUSE_ID_MAG_SIZE */
+	u32 id_mag_size;
+
+	/** per node depots of id magazines */
+	struct fuse_id_depot *id_depots;
 
 	/** per cpu id allocators */
 	struct fuse_per_cpu_ids __percpu *per_cpu_ids;
@@ -288,6 +483,48 @@ struct fuse_conn {
 
 	/** Called on final put */
 	void (*release)(struct fuse_conn *);
+
+	/** Queues shared with user space through mmap of the control device,
+	    allocated on the first mmap */
+	struct fuse_conn_queues *queue;
+
+	/** Serializes allocating the shared queues and counting mappings */
+	struct mutex queue_map_lock;
+
+	/** Mappings of the shared queues, queue mode is on while mapped */
+	u32 queue_maps;
+
+	/** New requests are published on the shared request queue, changed
+	    with both fc->lock and queue_lock held. Lock order is fc->lock,
+	    then a pending queue lock, then queue_lock. */
+	bool queue_mode;
+
+	/** Lock of the kernel as writer of the request queue */
+	spinlock_t queue_lock;
+
+	/** Cursors of the request queue. User space may scribble over the
+	    shared control blocks, the kernel keeps its own cursors and masks
+	    the indexes it reads from there. */
+	u32 queue_write;
+	u32 queue_read;
+
+	/** Read cursor of the user request queue, under user_queue_lock */
+	u32 user_queue_read;
+
+	/** Serializes consumers of the user request queue */
+	struct mutex user_queue_lock;
+
+	/** Registered buffers, NULL if none */
+	struct fuse_buffers *buffers;
+
+	/** Held for read while buffers are in use */
+	struct rw_semaphore buffers_sem;
+
+	/** Max time readers spin for requests, 0 if they do not spin */
+	u64 poll_max_ns;
+
+	/** Moving average of the time readers waited for requests */
+	u64 poll_avg_ns;
 };
 
 /** Device operations */
@@ -349,8 +586,52 @@ void fuse_conn_put(struct fuse_conn *fc);
 struct fuse_conn *fuse_conn_get(struct fuse_conn *fc);
 
 void fuse_restart_requests(struct fuse_conn *fc);
+
+/**
+ * Process up to @max requests posted on the user request queue, all of
+ * them if @max is zero. Returns the number of requests processed.
+ */
+int fuse_run_user_queue(struct fuse_conn *fc, u32 max);
+
+/**
+ * Wait up to @timeout_ms for requests on the request queue. Returns the
+ * number of requests available or a negative error.
+ */
+long fuse_queue_wait(struct fuse_conn *fc, u32 timeout_ms);
+
+/**
+ * Sum up the requests dispatched per class and the bulk requests
+ * dispatched ahead of urgent ones to avoid starving them.
+ */
+void fuse_prio_stats(struct fuse_conn *fc, u64 *dispatched, u64 *promoted);
+
+/**
+ * Set the max time readers spin for requests before sleeping, see
+ * PXD_IOC_SET_POLL.
+ */
+void fuse_set_poll(struct fuse_conn *fc, u32 max_spin_us);
+
+/**
+ * Pin and register the user buffer arena, see PXD_IOC_REGISTER_BUFFERS.
+ * Returns the number of buffers or a negative error.
+ */
+int fuse_register_buffers(struct fuse_conn *fc, u64 addr, u64 len,
+		u32 buf_size);
+int fuse_unregister_buffers(struct fuse_conn *fc);
+
+/**
+ * Set up @iter over @len bytes of registered buffer @index. On success the
+ * buffers stay registered until fuse_put_buffer() is called.
+ */
+int fuse_get_buffer(struct fuse_conn *fc, u32 index, int dir, size_t len,
+		struct iov_iter *iter);
+void fuse_put_buffer(struct fuse_conn *fc);
+
 void fuse_convert_zero_writes(struct fuse_req *req);
 
+/** Whether the data of write @req is all zero */
+bool fuse_req_data_zero(struct fuse_req *req);
+
 ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add);
 ssize_t pxd_remove(struct fuse_conn *fc, struct pxd_remove_out *remove);
 ssize_t pxd_update_size(struct fuse_conn *fc, struct pxd_update_size *update_size);
@@ -365,8 +646,11 @@ int pxd_set_fastpath(struct fuse_conn *fc, struct pxd_fastpath_out*);
 void fuse_request_init(struct fuse_req *req);
 void fuse_req_init_context(struct fuse_req *req);
 
-void request_end(struct fuse_conn *fc, struct fuse_req *req, bool lock);
+void request_end(struct fuse_conn *fc, struct fuse_req *req);
+bool fuse_request_cancel(struct fuse_conn *fc, struct fuse_req *req, int error);
 struct fuse_req *request_find(struct fuse_conn *fc, u64 unique);
+struct fuse_req *fuse_request_hold(struct fuse_conn *fc, u64 unique);
+void fuse_request_unhold(struct fuse_req *req);
 
 #endif
 #endif /* _FS_FUSE_I_H */
@@ -3,13 +3,50 @@
 #include <linux/version.h>
 #include <linux/blk_types.h>
 #include <linux/blkdev.h>
+#include <linux/uio.h>
 
 #include "pxd_compat.h"
 #include "pxd_core.h"
 #include "kiolib.h"
 
+// index of file among the replicas of pxd_dev, -1 if it is none of them
+static int pxd_file_index(struct pxd_device *pxd_dev, struct file *file) {
+        int i;
+
+        for (i = 0; i < pxd_dev->fp.nfd; i++) {
+                if (pxd_dev->fp.file[i] == file)
+                        return i;
+        }
+        return -1;
+}
+
+// data reached file, the next flush has to sync it.
+static void pxd_write_done(struct pxd_device *pxd_dev, struct file *file) {
+        int i = pxd_file_index(pxd_dev, file);
+
+        if (i >= 0)
+                atomic64_inc(&pxd_dev->fp.flushseq[i].write_epoch);
+}
+
+static int _pxd_fsync(struct pxd_device *pxd_dev, struct file *file) {
+        int ret = vfs_fsync(file, 0);
+
+        if (unlikely(ret && ret != -EINVAL && ret != -EIO)) {
+                ret = -EIO;
+        }
+        atomic_inc(&pxd_dev->fp.nio_flush);
+        return ret;
+}
+
+// a flush only has to cover the writes completed before it was issued.
+// it is a nop if none completed since the last fsync, and it joins the
+// next fsync if one is in progress: that one may have started before the
+// writes it waits for completed, the next one covers them all.
 static int _pxd_flush(struct pxd_device *pxd_dev, struct file *file) {
-        int ret = 0;
+        int i = pxd_file_index(pxd_dev, file);
+        struct pxd_flush_seq *seq;
+        s64 epoch;
+        int ret;
 
         // pxd_dev is opened in o_sync mode. all writes are complete with
         // implicit sync. explicit sync can be treated nop
@@ -18,11 +55,51 @@ static int _pxd_flush(struct pxd_device *pxd_dev, struct file *file) {
                 return 0;
         }
 
-        ret = vfs_fsync(file, 0);
+        if (i < 0)
+                return _pxd_fsync(pxd_dev, file);
+
+        seq = &pxd_dev->fp.flushseq[i];
+        epoch = atomic64_read(&seq->write_epoch);
+        if (atomic64_read(&seq->flush_epoch) >= epoch) {
+                atomic_inc(&pxd_dev->fp.nio_flush_nop);
+                return 0;
+        }
+
+        mutex_lock(&seq->lock);
+        if (atomic64_read(&seq->flush_epoch) >= epoch) {
+                atomic_inc(&pxd_dev->fp.nio_flush_coalesced);
+                ret = 0;
+        } else if (seq->err_epoch >= epoch) {
+                // the error is reported once per file, pass it on
+                atomic_inc(&pxd_dev->fp.nio_flush_coalesced);
+                ret = seq->err;
+        } else {
+                epoch = atomic64_read(&seq->write_epoch);
+                ret = _pxd_fsync(pxd_dev, file);
+                if (ret) {
+                        seq->err_epoch = epoch;
+                        seq->err = ret;
+                } else {
+                        atomic64_set(&seq->flush_epoch, epoch);
+                }
+        }
+        mutex_unlock(&seq->lock);
+
+        return ret;
+}
+
+// a FUA write only needs its own data durable, like a RWF_DSYNC write.
+static int _pxd_fua(struct pxd_device *pxd_dev, struct file *file,
+                    loff_t pos, size_t len) {
+        int ret;
+
+        if ((pxd_dev->mode & O_SYNC) || !len)
+                return 0;
+
+        ret = vfs_fsync_range(file, pos, pos + len - 1, 1);
         if (unlikely(ret && ret != -EINVAL && ret != -EIO)) {
                 ret = -EIO;
         }
-        atomic_inc(&pxd_dev->fp.nio_flush);
         return ret;
 }
 
@@ -44,18 +121,102 @@ static int _pxd_bio_discard(struct pxd_device *pxd_dev, struct file *file,
         if (unlikely(ret && ret != -EINVAL && ret != -EOPNOTSUPP))
                 return -EIO;
 
+        pxd_write_done(pxd_dev, file);
         return 0;
 }
 
-static int _pxd_write(uint64_t dev_id, struct file *file, struct bio_vec *bvec,
-                      loff_t *pos) {
-        ssize_t bw;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
+// maps the data left in bio into one iterator. bio may be split or a clone
+// sharing the vector of its parent, so start from bi_iter, not the vector.
+static void pxd_bio_iter(struct iov_iter *i, int rw, struct bio *bio) {
+        struct bio_vec *bvec = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
+        unsigned int nr_bvec = 0;
+        struct bvec_iter iter;
+        struct bio_vec bv;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0)
+        bio_for_each_bvec(bv, bio, iter)
+                nr_bvec++;
+#else
+        bio_for_each_segment(bv, bio, iter)
+                nr_bvec++;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+        iov_iter_bvec(i, rw, bvec, nr_bvec, bio->bi_iter.bi_size);
+#else
+        iov_iter_bvec(i, ITER_BVEC | rw, bvec, nr_bvec, bio->bi_iter.bi_size);
+#endif
+        i->iov_offset = bio->bi_iter.bi_bvec_done;
+}
+
+static int pxd_send(struct pxd_device *pxd_dev, struct file *file,
+                    struct bio *bio, loff_t pos) {
+        size_t len = bio->bi_iter.bi_size;
+        loff_t start = pos;
+        struct iov_iter i;
+        ssize_t bw;
+
+        pxd_printk(
+            "device %llu pxd_write entry offset %lld, length %zu entered\n",
+            pxd_dev->dev_id, pos, len);
+
+        if (unlikely(len % PXD_LBS)) {
+                printk(KERN_ERR "Unaligned block writes %zu bytes\n", len);
+        }
+
+        pxd_bio_iter(&i, WRITE, bio);
+        file_start_write(file);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+        bw = vfs_iter_write(file, &i, &pos, 0);
+#else
+        bw = vfs_iter_write(file, &i, &pos);
+#endif
+        file_end_write(file);
+
+        if (unlikely(bw != (ssize_t)len)) {
+                printk_ratelimited(KERN_ERR "device %llu Write error at byte "
+                                   "offset %lld, length %zu, write %zd\n",
+                                   pxd_dev->dev_id, start, len, bw);
+                return bw < 0 ? bw : -EIO;
+        }
+
+        pxd_write_done(pxd_dev, file);
+        atomic_inc(&pxd_dev->fp.nio_write);
+        return 0;
+}
+
+static ssize_t pxd_receive(struct pxd_device *pxd_dev, struct file *file,
+                           struct bio *bio, loff_t *pos) {
+        loff_t start = *pos;
         struct iov_iter i;
+        ssize_t s;
+
+        /* read from file at offset pos into the bio */
+        pxd_bio_iter(&i, READ, bio);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+        s = vfs_iter_read(file, &i, pos, 0);
+#else
+        s = vfs_iter_read(file, &i, pos);
+#endif
+        if (s < 0) {
+                printk_ratelimited(KERN_ERR
+                                   "device %llu: read offset %lld failed %zd\n",
+                                   pxd_dev->dev_id, start, s);
+                return s;
+        }
+
+        /* past the end of the file, the rest reads as zeroes */
+        if (iov_iter_count(&i))
+                iov_iter_zero(iov_iter_count(&i), &i);
+        return 0;
+}
 #else
+static int _pxd_write(uint64_t dev_id, struct file *file, struct bio_vec *bvec,
+                      loff_t *pos) {
+        ssize_t bw;
         mm_segment_t old_fs = get_fs();
         void *kaddr = kmap(bvec->bv_page) + bvec->bv_offset;
-#endif
 
         pxd_printk(
             "device %llu pxd_write entry offset %lld, length %d entered\n",
@@ -65,27 +226,10 @@ static int _pxd_write(uint64_t dev_id, struct file *file, struct bio_vec *bvec,
                 printk(KERN_ERR "Unaligned block writes %d bytes\n",
                        bvec->bv_len);
         }
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-        iov_iter_bvec(&i, WRITE, bvec, 1, bvec->bv_len);
-        file_start_write(file);
-        bw = vfs_iter_write(file, &i, pos, 0);
-        file_end_write(file);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
-        iov_iter_bvec(&i, ITER_BVEC | WRITE, bvec, 1, bvec->bv_len);
-        file_start_write(file);
-        bw = vfs_iter_write(file, &i, pos, 0);
-        file_end_write(file);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-        iov_iter_bvec(&i, ITER_BVEC | WRITE, bvec, 1, bvec->bv_len);
-        file_start_write(file);
-        bw = vfs_iter_write(file, &i, pos);
-        file_end_write(file);
-#else
         set_fs(KERNEL_DS);
         bw = vfs_write(file, kaddr, bvec->bv_len, pos);
         kunmap(bvec->bv_page);
         set_fs(old_fs);
-#endif
 
         if (likely(bw == bvec->bv_len)) {
                 return 0;
@@ -102,32 +246,16 @@ static int _pxd_write(uint64_t dev_id, struct file *file, struct bio_vec *bvec,
 static int pxd_send(struct pxd_device *pxd_dev, struct file *file,
                     struct bio *bio, loff_t pos) {
         int ret = 0;
-        int nsegs = 0;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-        struct bio_vec bvec;
-        struct bvec_iter i;
-#else
         struct bio_vec *bvec;
         int i;
-#endif
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-        bio_for_each_segment(bvec, bio, i) {
-                nsegs++;
-                ret = _pxd_write(pxd_dev->dev_id, file, &bvec, &pos);
-                if (ret < 0) {
-                        return ret;
-                }
-        }
-#else
         bio_for_each_segment(bvec, bio, i) {
-                nsegs++;
                 ret = _pxd_write(pxd_dev->dev_id, file, bvec, &pos);
                 if (ret < 0) {
                         return ret;
                 }
         }
-#endif
+        pxd_write_done(pxd_dev, file);
         atomic_inc(&pxd_dev->fp.nio_write);
         return 0;
 }
@@ -137,22 +265,6 @@ static ssize_t _pxd_read(uint64_t dev_id, struct file *file,
         int result = 0;
 
         /* read from file at offset pos into the buffer */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
-        struct iov_iter i;
-
-        iov_iter_bvec(&i, READ, bvec, 1, bvec->bv_len);
-        result = vfs_iter_read(file, &i, pos, 0);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
-        struct iov_iter i;
-
-        iov_iter_bvec(&i, ITER_BVEC | READ, bvec, 1, bvec->bv_len);
-        result = vfs_iter_read(file, &i, pos, 0);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-        struct iov_iter i;
-
-        iov_iter_bvec(&i, ITER_BVEC | READ, bvec, 1, bvec->bv_len);
-        result = vfs_iter_read(file, &i, pos);
-#else
         mm_segment_t old_fs = get_fs();
         void *kaddr = kmap(bvec->bv_page) + bvec->bv_offset;
 
@@ -160,7 +272,6 @@ static ssize_t _pxd_read(uint64_t dev_id, struct file *file,
         result = vfs_read(file, kaddr, bvec->bv_len, pos);
         set_fs(old_fs);
         kunmap(bvec->bv_page);
-#endif
         if (result < 0)
                 printk_ratelimited(KERN_ERR
                                    "device %llu: read offset %lld failed %d\n",
@@ -171,25 +282,10 @@ static ssize_t _pxd_read(uint64_t dev_id, struct file *file,
 static ssize_t pxd_receive(struct pxd_device *pxd_dev, struct file *file,
                            struct bio *bio, loff_t *pos) {
         ssize_t s;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-        struct bio_vec bvec;
-        struct bvec_iter i;
-#else
         struct bio_vec *bvec;
         int i;
-#endif
 
         bio_for_each_segment(bvec, bio, i) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
-                s = _pxd_read(pxd_dev->dev_id, file, &bvec, pos);
-                if (s < 0)
-                        return s;
-
-                if (s != bvec.bv_len) {
-                        zero_fill_bio(bio);
-                        break;
-                }
-#else
                 s = _pxd_read(pxd_dev->dev_id, file, bvec, pos);
                 if (s < 0)
                         return s;
@@ -198,10 +294,10 @@ static ssize_t pxd_receive(struct pxd_device *pxd_dev, struct file *file,
                         zero_fill_bio(bio);
                         break;
                 }
-#endif
         }
         return 0;
 }
+#endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
 int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
@@ -235,7 +331,8 @@ int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
 
                 if (bio->bi_opf & REQ_FUA) {
                         atomic_inc(&pxd_dev->fp.nio_fua);
-                        ret = _pxd_flush(pxd_dev, file);
+                        ret = _pxd_fua(pxd_dev, file, pos,
+                                       bio->bi_iter.bi_size);
                         if (ret < 0)
                                 goto out;
                 }
@@ -263,6 +360,107 @@ out:
         return ret;
 }
 
+static void pxd_kiocb_end(struct pxd_kiocb *kio, long ret) {
+        struct bio *bio = kio->bio;
+        struct pxd_device *pxd_dev = kio->pxd_dev;
+        bool write = bio_op(bio) == REQ_OP_WRITE;
+        loff_t pos = (loff_t)bio->bi_iter.bi_sector << SECTOR_SHIFT;
+
+        if (ret == bio->bi_iter.bi_size) {
+                ret = 0;
+        } else if (ret >= 0 && !write) {
+                // past the end of the file, the rest reads as zeroes
+                bio_advance(bio, ret);
+                zero_fill_bio(bio);
+                ret = 0;
+        } else {
+                printk_ratelimited(KERN_ERR "device %llu: %s offset %lld, "
+                                   "length %u failed %ld\n",
+                                   pxd_dev->dev_id, write ? "write" : "read",
+                                   pos, bio->bi_iter.bi_size, ret);
+                if (ret >= 0)
+                        ret = -EIO;
+        }
+
+        if (!ret && write) {
+                pxd_write_done(pxd_dev, kio->iocb.ki_filp);
+                atomic_inc(&pxd_dev->fp.nio_write);
+        }
+        BIO_ENDIO(bio, ret);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+static void pxd_kiocb_complete(struct kiocb *iocb, long ret) {
+#else
+static void pxd_kiocb_complete(struct kiocb *iocb, long ret, long ret2) {
+#endif
+        pxd_kiocb_end(container_of(iocb, struct pxd_kiocb, iocb), ret);
+}
+
+// flushes and FUA writes need the fsync ordering of __do_bio_filebacked.
+int __do_bio_filebacked_async(struct pxd_device *pxd_dev, struct bio *bio,
+                              struct file *file, struct pxd_kiocb *kio) {
+        unsigned int op = bio_op(bio);
+        struct iov_iter i;
+        ssize_t ret;
+
+        BUG_ON(pxd_dev->magic != PXD_DEV_MAGIC);
+
+        if ((op != REQ_OP_READ && op != REQ_OP_WRITE) ||
+            (bio->bi_opf & (REQ_PREFLUSH | REQ_FUA)))
+                return -EOPNOTSUPP;
+        if (op == REQ_OP_WRITE ? !file->f_op->write_iter :
+                                 !file->f_op->read_iter)
+                return -EOPNOTSUPP;
+
+        init_sync_kiocb(&kio->iocb, file);
+        kio->iocb.ki_pos = (loff_t)bio->bi_iter.bi_sector << SECTOR_SHIFT;
+        kio->iocb.ki_complete = pxd_kiocb_complete;
+        kio->pxd_dev = pxd_dev;
+        kio->bio = bio;
+
+        if (op == REQ_OP_WRITE) {
+                pxd_bio_iter(&i, WRITE, bio);
+                ret = file->f_op->write_iter(&kio->iocb, &i);
+        } else {
+                pxd_bio_iter(&i, READ, bio);
+                ret = file->f_op->read_iter(&kio->iocb, &i);
+        }
+
+        if (ret != -EIOCBQUEUED)
+                pxd_kiocb_end(kio, ret);
+        return 0;
+}
+
+// an all zero write, zero the range instead so sparse files stay sparse.
+// writes the data if the file cannot zero ranges.
+int __do_bio_zeroes_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
+                               struct file *file) {
+        int mode = FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE;
+        loff_t pos;
+        int ret = -EOPNOTSUPP;
+
+        BUG_ON(pxd_dev->magic != PXD_DEV_MAGIC);
+        BUG_ON(bio_op(bio) != REQ_OP_WRITE);
+
+        pos = ((loff_t)bio->bi_iter.bi_sector << SECTOR_SHIFT);
+        if (file->f_op->fallocate)
+                ret = file->f_op->fallocate(file, mode, pos,
+                                            bio->bi_iter.bi_size);
+        if (ret == -EOPNOTSUPP)
+                return __do_bio_filebacked(pxd_dev, bio, file);
+
+        if (unlikely(ret)) {
+                ret = -EIO;
+        } else {
+                pxd_write_done(pxd_dev, file);
+                atomic_inc(&pxd_dev->fp.nio_write_zeroes);
+        }
+
+        BIO_ENDIO(bio, ret);
+        return ret;
+}
+
 #else
 int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
                         struct file *file) {
@@ -298,7 +496,12 @@ int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
                 if (!ret) {
                         if ((bio->bi_rw & REQ_FUA)) {
                                 atomic_inc(&pxd_dev->fp.nio_fua);
-                                ret = _pxd_flush(pxd_dev, file);
+                                // a flush syncs the whole file anyway
+                                if (bio->bi_rw & REQ_FLUSH)
+                                        ret = _pxd_flush(pxd_dev, file);
+                                else
+                                        ret = _pxd_fua(pxd_dev, file, pos,
+                                                       BIO_SIZE(bio));
                                 if (ret < 0)
                                         goto out;
                         } else if ((bio->bi_rw & REQ_FLUSH)) {
@@ -316,4 +519,15 @@ out:
         BIO_ENDIO(bio, ret);
         return ret;
 }
+
+int __do_bio_filebacked_async(struct pxd_device *pxd_dev, struct bio *bio,
+                              struct file *file, struct pxd_kiocb *kio) {
+        return -EOPNOTSUPP;
+}
+
+// zero writes are not detected on these kernels
+int __do_bio_zeroes_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
+                               struct file *file) {
+        return __do_bio_filebacked(pxd_dev, bio, file);
+}
 #endif
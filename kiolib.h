@@ -1,11 +1,31 @@
 #ifndef _KIOLIB_H_
 #define _KIOLIB_H_
 
+#include <linux/fs.h>
+
 struct file;
 struct pxd_device;
 struct bio;
 
+/** A file IO in flight for a bio, see __do_bio_filebacked_async() */
+struct pxd_kiocb {
+        struct kiocb iocb;
+        struct pxd_device *pxd_dev;
+        struct bio *bio;
+};
+
 int __do_bio_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
                         struct file *file);
+/**
+ * Start a read or write of bio without waiting for the file, the bio is
+ * ended from the completion. Files opened O_DIRECT complete asynchronously,
+ * others still complete before returning. kio must stay around until the
+ * bio ends. Returns -EOPNOTSUPP if the bio has to go through
+ * __do_bio_filebacked() instead.
+ */
+int __do_bio_filebacked_async(struct pxd_device *pxd_dev, struct bio *bio,
+                              struct file *file, struct pxd_kiocb *kio);
+int __do_bio_zeroes_filebacked(struct pxd_device *pxd_dev, struct bio *bio,
+                               struct file *file);
 
 #endif /* _KIOLIB_H_ */
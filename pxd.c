@@ -78,12 +78,18 @@ uint32_t pxd_num_contexts = PXD_NUM_CONTEXTS;
 uint32_t pxd_num_contexts_exported = PXD_NUM_CONTEXT_EXPORTED;
 uint32_t pxd_timeout_secs = PXD_TIMER_SECS_DEFAULT;
 uint32_t pxd_detect_zero_writes = 0;
+uint32_t pxd_inline_write_size = 0;
+uint32_t pxd_prio_ratio = 8;
 uint32_t pxd_num_fpthreads = DEFAULT_PXFP_WORKERS_PER_NODE;
+uint32_t pxd_fastpath_aio = 0;
 
 module_param(pxd_num_contexts_exported, uint, 0644);
 module_param(pxd_num_contexts, uint, 0644);
 module_param(pxd_detect_zero_writes, uint, 0644);
+module_param(pxd_inline_write_size, uint, 0644);
+module_param(pxd_prio_ratio, uint, 0644);
 module_param(pxd_num_fpthreads, uint, 0644);
+module_param(pxd_fastpath_aio, uint, 0644);
 
 static void pxd_abort_context(struct work_struct *work);
 static int pxd_nodewipe_cleanup(struct pxd_context *ctx);
@@ -164,6 +170,7 @@ static long pxd_ioctl_dump_fc_info(void)
 {
 	int i;
 	struct pxd_context *ctx;
+	u64 dispatched[FUSE_PRIO_MAX], promoted;
 
 	for (i = 0; i < pxd_num_contexts; ++i) {
 		ctx = &pxd_contexts[i];
@@ -173,6 +180,10 @@ static long pxd_ioctl_dump_fc_info(void)
 		printk(KERN_INFO "%s: pxd_ctx: %s ndevices: %lu",
 			__func__, ctx->name, ctx->num_devices);
 		printk(KERN_INFO "\tFC: connected: %d", READ_ONCE(ctx->fc.connected));
+		fuse_prio_stats(&ctx->fc, dispatched, &promoted);
+		printk(KERN_INFO "\tFC: urgent: %llu bulk: %llu promoted: %llu",
+			dispatched[FUSE_PRIO_URGENT], dispatched[FUSE_PRIO_BULK],
+			promoted);
 	}
 	return 0;
 }
@@ -373,6 +384,105 @@ static long pxd_ioflusher_state(void __user *argp)
 	return 0;
 }
 
+static long pxd_ioctl_run_queue(struct file *file, void __user *argp,
+		bool wait)
+{
+	struct pxd_context *ctx = container_of(file->f_op, struct pxd_context, fops);
+	struct fuse_conn *fc = file->private_data;
+	struct pxd_ioctl_run_queue_args args;
+	long rc;
+
+	if (!fc)
+		return -EPERM;
+
+	memset(&args, 0, sizeof(args));
+	if (argp && copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	args.processed = fuse_run_user_queue(fc, args.max_batch);
+	if (wait)
+		args.processed += pxd_io_ring_run(&ctx->io_ring, fc,
+						  args.max_batch);
+
+	rc = fuse_queue_wait(fc, wait ? args.timeout_ms : 0);
+	if (rc < 0)
+		return rc;
+	args.pending = rc;
+
+	if (argp && copy_to_user(argp, &args, sizeof(args)))
+		return -EFAULT;
+
+	return wait ? args.pending : args.processed;
+}
+
+static long pxd_ioctl_register_file(struct file *file, void __user *argp,
+		bool reg)
+{
+	struct pxd_context *ctx = container_of(file->f_op, struct pxd_context, fops);
+	struct pxd_ioctl_register_file_args args;
+	int rc;
+
+	if (!file->private_data)
+		return -EPERM;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (!reg)
+		return pxd_io_ring_unregister_file(&ctx->io_ring, args.index);
+
+	rc = pxd_io_ring_register_file(&ctx->io_ring, args.fd);
+	if (rc < 0)
+		return rc;
+
+	args.index = rc;
+	if (copy_to_user(argp, &args, sizeof(args))) {
+		pxd_io_ring_unregister_file(&ctx->io_ring, args.index);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long pxd_ioctl_register_buffers(struct file *file, void __user *argp)
+{
+	struct fuse_conn *fc = file->private_data;
+	struct pxd_ioctl_register_buffers_args args;
+
+	if (!fc)
+		return -EPERM;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	return fuse_register_buffers(fc, args.addr, args.len, args.buf_size);
+}
+
+static long pxd_ioctl_unregister_buffers(struct file *file)
+{
+	struct fuse_conn *fc = file->private_data;
+
+	if (!fc)
+		return -EPERM;
+
+	return fuse_unregister_buffers(fc);
+}
+
+static long pxd_ioctl_set_poll(struct file *file, void __user *argp)
+{
+	struct fuse_conn *fc = file->private_data;
+	struct pxd_ioctl_poll_args args;
+
+	if (!fc)
+		return -EPERM;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	fuse_set_poll(fc, args.max_spin_us);
+	return 0;
+}
+
 static long pxd_control_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	switch (cmd) {
@@ -384,6 +494,20 @@ static long pxd_control_ioctl(struct file *file, unsigned int cmd, unsigned long
 		return pxd_ioctl_init(file, (void __user *)arg);
 	case PXD_IOC_RESIZE:
 		return pxd_ioctl_resize(file, (void __user *)arg);
+	case PXD_IOC_RUN_USER_QUEUE:
+		return pxd_ioctl_run_queue(file, (void __user *)arg, false);
+	case PXD_IOC_RUN_IO_QUEUE:
+		return pxd_ioctl_run_queue(file, (void __user *)arg, true);
+	case PXD_IOC_REGISTER_FILE:
+		return pxd_ioctl_register_file(file, (void __user *)arg, true);
+	case PXD_IOC_UNREGISTER_FILE:
+		return pxd_ioctl_register_file(file, (void __user *)arg, false);
+	case PXD_IOC_REGISTER_BUFFERS:
+		return pxd_ioctl_register_buffers(file, (void __user *)arg);
+	case PXD_IOC_UNREGISTER_BUFFERS:
+		return pxd_ioctl_unregister_buffers(file);
+	case PXD_IOC_SET_POLL:
+		return pxd_ioctl_set_poll(file, (void __user *)arg);
 	case PXD_IOC_FPCLEANUP:
 		return pxd_ioctl_fp_cleanup(file, (void __user *)arg);
 	case PXD_IOC_IO_FLUSHER:
@@ -534,6 +658,7 @@ static bool pxd_process_write_reply(struct fuse_conn *fc, struct fuse_req *req,
 #else
 	pxd_update_stats(req, 1, BIO_SIZE(req->bio) / SECTOR_SIZE);
 #endif
+	pxd_flush_seq_invalidate(&req->pxd_dev->fp);
 	BIO_ENDIO(req->bio, status);
 	pxd_request_complete(fc, req, status);
 
@@ -560,7 +685,8 @@ static bool pxd_process_read_reply_q(struct fuse_conn *fc, struct fuse_req *req,
 static bool pxd_process_write_reply_q(struct fuse_conn *fc, struct fuse_req *req,
 		int status)
 {
-
+	/* px-storage wrote the replicas, fastpath flushes have to sync it */
+	pxd_flush_seq_invalidate(&req->pxd_dev->fp);
 	pxd_request_complete(fc, req, status);
 #ifndef __PX_BLKMQ__
 	blk_end_request(req->rq, status, blk_rq_bytes(req->rq));
@@ -734,6 +860,11 @@ static int pxd_write_request(struct fuse_req *req, uint32_t size, uint64_t off,
 
 	pxd_req_misc(req, size, off, minor, flags);
 
+	/* block checksums are computed while user space copies the data */
+	if (READ_ONCE(req->pxd_dev->csum) && size &&
+	    !((off | size) & PXD_LBS_MASK))
+		req->pxd_rdwr_in.flags |= PXD_FLAGS_CSUM;
+
 	if (pxd_detect_zero_writes && req->pxd_rdwr_in.size != 0)
 		fuse_convert_zero_writes(req);
 
@@ -1021,6 +1152,27 @@ void pxd_reroute_slowpath(struct request_queue *q, struct bio *bio)
 #endif
 
 #ifdef __PXD_BIO_BLKMQ__
+/* Charge a request against the limits of its device, see pxd_qos_charge() */
+static u64 pxd_qos_charge_rq(struct pxd_device *pxd_dev, struct request *rq)
+{
+	bool write = rq_data_dir(rq) == WRITE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0) || defined(REQ_PREFLUSH)
+	bool data = req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE;
+#else
+	bool data = !(rq->cmd_flags & (REQ_DISCARD | REQ_WRITE_SAME));
+#endif
+
+	if (!pxd_qos_enabled(&pxd_dev->qos))
+		return 0;
+
+	return pxd_qos_charge(&pxd_dev->qos, write, data ? blk_rq_bytes(rq) : 0);
+}
+
+static unsigned long pxd_qos_delay_ms(u64 wait)
+{
+	return max_t(unsigned long, div_u64(wait, NSEC_PER_MSEC), 1);
+}
+
 #if !defined(__PX_BLKMQ__)
 void pxdmq_reroute_slowpath(struct fuse_req *req)
 {
@@ -1049,6 +1201,7 @@ static void pxd_rq_fn(struct request_queue *q)
 	struct pxd_device *pxd_dev = q->queuedata;
 	struct fuse_req *req;
 	struct fuse_conn *fc = &pxd_dev->ctx->fc;
+	u64 wait;
 
 	for (;;) {
 		struct request *rq;
@@ -1063,6 +1216,14 @@ static void pxd_rq_fn(struct request_queue *q)
 			__blk_end_request_all(rq, 0);
 			continue;
 		}
+
+		/* over the device limits, retry once tokens are available */
+		wait = pxd_qos_charge_rq(pxd_dev, rq);
+		if (wait) {
+			blk_requeue_request(q, rq);
+			blk_delay_queue(q, pxd_qos_delay_ms(wait));
+			break;
+		}
 		spin_unlock_irq(&pxd_dev->qlock);
 		pxd_printk("%s: dev m %d g %lld %s at %ld len %d bytes %d pages "
 			"flags  %llx\n", __func__,
@@ -1137,10 +1298,18 @@ static blk_status_t pxd_queue_rq(struct blk_mq_hw_ctx *hctx,
 	struct pxd_device *pxd_dev = rq->q->queuedata;
 	struct fuse_req *req = blk_mq_rq_to_pdu(rq);
 	struct fuse_conn *fc = &pxd_dev->ctx->fc;
+	u64 wait;
 
 	if (BLK_RQ_IS_PASSTHROUGH(rq) || !READ_ONCE(fc->allow_disconnected))
 		return BLK_STS_IOERR;
 
+	/* over the device limits, requeue rather than block the submitter */
+	wait = pxd_qos_charge_rq(pxd_dev, rq);
+	if (wait) {
+		blk_mq_delay_run_hw_queue(hctx, pxd_qos_delay_ms(wait));
+		return BLK_STS_RESOURCE;
+	}
+
 	pxd_printk("%s: dev m %d g %lld %s at %ld len %d bytes %d pages "
 		   "flags  %x\n", __func__,
 		pxd_dev->minor, pxd_dev->dev_id,
@@ -1377,6 +1546,7 @@ static void pxd_free_disk(struct pxd_device *pxd_dev)
 	if (!disk)
 		return;
 
+	pxd_qos_destroy(&pxd_dev->qos);
 	pxd_fastpath_cleanup(pxd_dev);
 	pxd_dev->disk = NULL;
 	if (disk) {
@@ -1485,6 +1655,12 @@ ssize_t pxd_add(struct fuse_conn *fc, struct pxd_add_ext_out *add)
 	pxd_dev->nr_congestion_off = 0;
 	atomic_set(&pxd_dev->ncount, 0);
 
+#if defined(__PXD_BIO_MAKEREQ__) && defined(__PX_FASTPATH__)
+	pxd_qos_init(&pxd_dev->qos, pxd_bio_qos_dispatch);
+#else
+	pxd_qos_init(&pxd_dev->qos, NULL);
+#endif
+
 	pxd_dev->queue_depth = PXD_MAX_QDEPTH;
 	if (add->queue_depth < 0 || add->queue_depth > PXD_MAX_QDEPTH) {
 		err = -EINVAL;
@@ -1961,11 +2137,13 @@ static ssize_t pxd_active_show(struct device *dev,
 	int available = PAGE_SIZE - 1;
 	int i;
 
-	ncount = snprintf(cp, available, "active/complete: %u/%u, failed: %u, [write: %u, flush: %u(nop: %u), fua: %u, discard: %u, preflush: %u], switched: %u, slowpath: %u\n",
+	ncount = snprintf(cp, available, "active/complete: %u/%u, failed: %u, [write: %u, write zeroes: %u, flush: %u(nop: %u, coalesced: %u), fua: %u, discard: %u, preflush: %u], switched: %u, slowpath: %u\n",
                 atomic_read(&pxd_dev->ncount), atomic_read(&pxd_dev->fp.ncomplete),
 		atomic_read(&pxd_dev->fp.nerror),
 		atomic_read(&pxd_dev->fp.nio_write),
+		atomic_read(&pxd_dev->fp.nio_write_zeroes),
 		atomic_read(&pxd_dev->fp.nio_flush), atomic_read(&pxd_dev->fp.nio_flush_nop),
+		atomic_read(&pxd_dev->fp.nio_flush_coalesced),
 		atomic_read(&pxd_dev->fp.nio_fua), atomic_read(&pxd_dev->fp.nio_discard),
 		atomic_read(&pxd_dev->fp.nio_preflush),
 		atomic_read(&pxd_dev->fp.nswitch), atomic_read(&pxd_dev->fp.nslowPath));
@@ -2026,6 +2204,107 @@ static ssize_t pxd_congestion_set(struct device *dev, struct device_attribute *a
 	return count;
 }
 
+static ssize_t pxd_qos_attr_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+
+	return pxd_qos_show(&pxd_dev->qos, buf);
+}
+
+static ssize_t pxd_qos_attr_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+	int rc;
+
+	rc = pxd_qos_parse(&pxd_dev->qos, buf);
+	if (rc)
+		return rc;
+
+	return count;
+}
+
+static ssize_t pxd_csum_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(pxd_dev->csum));
+}
+
+static ssize_t pxd_csum_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+	unsigned int enable;
+
+	if (kstrtouint(buf, 0, &enable) || enable > 1)
+		return -EINVAL;
+
+	WRITE_ONCE(pxd_dev->csum, enable);
+	return count;
+}
+
+static const char * const pxd_read_policy_names[PXD_READ_NR_POLICIES] = {
+	[PXD_READ_FIRST] = "first",
+	[PXD_READ_ROUND_ROBIN] = "round-robin",
+	[PXD_READ_LEAST_BUSY] = "least-busy",
+	[PXD_READ_LATENCY] = "latency",
+};
+
+static ssize_t pxd_read_policy_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+	int policy = READ_ONCE(pxd_dev->fp.read_policy);
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < PXD_READ_NR_POLICIES; i++)
+		len += sprintf(buf + len, i == policy ? "[%s] " : "%s ",
+			pxd_read_policy_names[i]);
+	buf[len - 1] = '\n';
+	return len;
+}
+
+static ssize_t pxd_read_policy_store(struct device *dev,
+			struct device_attribute *attr,
+			const char *buf, size_t count)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+	int i;
+
+	for (i = 0; i < PXD_READ_NR_POLICIES; i++) {
+		if (sysfs_streq(buf, pxd_read_policy_names[i])) {
+			WRITE_ONCE(pxd_dev->fp.read_policy, i);
+			return count;
+		}
+	}
+	return -EINVAL;
+}
+
+static ssize_t pxd_read_stats_show(struct device *dev,
+					 struct device_attribute *attr, char *buf)
+{
+	struct pxd_device *pxd_dev = dev_to_pxd_dev(dev);
+	struct pxd_read_stats *rs;
+	ssize_t len = 0;
+	int i;
+
+	for (i = 0; i < pxd_dev->fp.nfd; i++) {
+		rs = &pxd_dev->fp.rstats[i];
+		len += scnprintf(buf + len, PAGE_SIZE - len,
+			"%s reads: %u, inflight: %u, latency(us): %llu\n",
+			pxd_dev->fp.device_path[i], atomic_read(&rs->nreads),
+			atomic_read(&rs->inflight),
+			div_u64(atomic64_read(&rs->ewma_ns), NSEC_PER_USEC));
+	}
+	return len;
+}
+
 static ssize_t pxd_fastpath_state(struct device *dev,
 					 struct device_attribute *attr, char *buf)
 {
@@ -2267,6 +2546,10 @@ static DEVICE_ATTR(mode, S_IRUGO, pxd_mode_show, NULL);
 static DEVICE_ATTR(debug, S_IRUGO|S_IWUSR, pxd_debug_show, pxd_debug_store);
 static DEVICE_ATTR(inprogress, S_IRUGO, pxd_inprogress_show, NULL);
 static DEVICE_ATTR(release, S_IWUSR, NULL, pxd_release_store);
+static DEVICE_ATTR(qos, S_IRUGO|S_IWUSR, pxd_qos_attr_show, pxd_qos_attr_store);
+static DEVICE_ATTR(checksum, S_IRUGO|S_IWUSR, pxd_csum_show, pxd_csum_store);
+static DEVICE_ATTR(read_policy, S_IRUGO|S_IWUSR, pxd_read_policy_show, pxd_read_policy_store);
+static DEVICE_ATTR(read_stats, S_IRUGO, pxd_read_stats_show, NULL);
 
 static struct attribute *pxd_attrs[] = {
 	&dev_attr_size.attr,
@@ -2280,6 +2563,10 @@ static struct attribute *pxd_attrs[] = {
 	&dev_attr_debug.attr,
 	&dev_attr_inprogress.attr,
 	&dev_attr_release.attr,
+	&dev_attr_qos.attr,
+	&dev_attr_checksum.attr,
+	&dev_attr_read_policy.attr,
+	&dev_attr_read_stats.attr,
 	NULL
 };
 
@@ -2384,6 +2671,7 @@ static int pxd_control_open(struct inode *inode, struct file *file)
 	// abort work cannot be active while restarting requests
 	cancel_delayed_work_sync(&ctx->abort_work);
 	fuse_restart_requests(fc);
+	pxd_io_ring_reset(&ctx->io_ring);
 
 	spin_lock(&ctx->lock);
 	pxd_timeout_secs = PXD_TIMER_SECS_DEFAULT;
@@ -2422,11 +2710,28 @@ static int pxd_control_release(struct inode *inode, struct file *file)
 	schedule_delayed_work(&ctx->abort_work, pxd_timeout_secs * HZ);
 	spin_unlock(&ctx->lock);
 
+	pxd_io_ring_unregister_files(&ctx->io_ring);
+	fuse_unregister_buffers(&ctx->fc);
+
 	printk(KERN_INFO "%s: pxd-control-%d(%lld) close OK\n", __func__, ctx->id,
 		ctx->open_seq);
 	return 0;
 }
 
+/* The io ring queues are mapped at PXD_IO_RING_OFFSET, fuse queues at 0 */
+static int pxd_control_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct pxd_context *ctx = container_of(file->f_op, struct pxd_context, fops);
+
+	if (!file->private_data)
+		return -EPERM;
+
+	if (vma->vm_pgoff == (PXD_IO_RING_OFFSET >> PAGE_SHIFT))
+		return pxd_io_ring_mmap(&ctx->io_ring, vma);
+
+	return fuse_dev_operations.mmap(file, vma);
+}
+
 static struct miscdevice pxd_miscdev = {
 	.minor		= MISC_DYNAMIC_MINOR,
 	.name		= "pxd/pxd-control",
@@ -2472,6 +2777,8 @@ static int pxd_context_init(struct pxd_context *ctx, int i)
 	ctx->fops.open = pxd_control_open;
 	ctx->fops.release = pxd_control_release;
 	ctx->fops.unlocked_ioctl = pxd_control_ioctl;
+	ctx->fops.mmap = pxd_control_mmap;
+	pxd_io_ring_init(&ctx->io_ring);
 
 	if (ctx->id < pxd_num_contexts_exported) {
 		err = fuse_conn_init(&ctx->fc);
@@ -2498,6 +2805,7 @@ static void pxd_context_destroy(struct pxd_context *ctx)
 		fuse_abort_conn(&ctx->fc);
 		fuse_conn_put(&ctx->fc);
 	}
+	pxd_io_ring_destroy(&ctx->io_ring);
 }
 
 static int pxd_init(void)
@@ -2610,4 +2918,5 @@ module_init(pxd_init);
 module_exit(pxd_exit);
 
 MODULE_LICENSE("GPL");
+MODULE_SOFTDEP("pre: crc32c");
 MODULE_VERSION(VERTOSTR(PXD_VERSION));
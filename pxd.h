@@ -43,6 +43,9 @@
 #define PXD_IOC_UNREGISTER_FILE	_IO(PXD_IOCTL_MAGIC, 8)		/* 0x505808 */
 #define PXD_IOC_FPCLEANUP		_IO(PXD_IOCTL_MAGIC, 9)		/* 0x505809 */
 #define PXD_IOC_IO_FLUSHER		_IO(PXD_IOCTL_MAGIC, 10)	/* 0x50580a */
+#define PXD_IOC_REGISTER_BUFFERS	_IO(PXD_IOCTL_MAGIC, 11)	/* 0x50580b */
+#define PXD_IOC_UNREGISTER_BUFFERS	_IO(PXD_IOCTL_MAGIC, 12)	/* 0x50580c */
+#define PXD_IOC_SET_POLL		_IO(PXD_IOCTL_MAGIC, 13)	/* 0x50580d */
 
 #define PXD_MAX_DEVICES	512			/**< maximum number of devices supported */
 #define PXD_MAX_IO		(1024*1024)	/**< maximum io size in bytes */
@@ -86,6 +89,9 @@ enum pxd_opcode {
 	PXD_FALLBACK_TO_KERNEL,   /**< Fallback requests suspend IO and send in a marker req
 						  from kernel on a suspended device */
 	PXD_EXPORT_DEV,     /**< export the attached device to the kernel */
+	PXD_READ_DATA_FIXED,	/**< read data from kernel into a registered buffer */
+	PXD_REPLY_FIXED,	/**< complete request with data from a registered buffer */
+	PXD_READ_DATA_CSUM,	/**< read data from kernel along with block checksums */
 	PXD_LAST,
 };
 
@@ -93,11 +99,33 @@ enum pxd_opcode {
 #define PXD_FLAGS_FLUSH 0x1	/**< REQ_FLUSH set on bio */
 #define PXD_FLAGS_FUA	0x2	/**< REQ_FUA set on bio */
 #define PXD_FLAGS_META	0x4	/**< REQ_META set on bio */
+#define PXD_FLAGS_INLINE 0x8	/**< write payload follows the request, in.len includes it */
+#define PXD_FLAGS_ZERO_MAP 0x10	/**< write is followed by a map of its zero blocks */
+#define PXD_FLAGS_CSUM 0x20	/**< block checksums are returned with the write data */
 #define PXD_FLAGS_SYNC (PXD_FLAGS_FLUSH | PXD_FLAGS_FUA)
 
 #define PXD_LBS (4 * 1024) 	/**< logical block size */
 #define PXD_LBS_MASK (PXD_LBS - 1)
 
+/**
+ * A write with PXD_FLAGS_ZERO_MAP is followed by DIV_ROUND_UP(blocks, 64)
+ * uint64_t words, bit i % 64 of word i / 64 is set when block i of the
+ * write is all zero. The data of zero blocks need not be read. Set for
+ * block aligned writes with pxd_detect_zero_writes=2.
+ */
+#define PXD_ZERO_MAP_BLOCKS (PXD_MAX_IO / PXD_LBS)
+#define PXD_ZERO_MAP_WORDS (PXD_ZERO_MAP_BLOCKS / 64)
+
+/**
+ * A write with PXD_FLAGS_CSUM is block aligned. While its data is copied
+ * out, the kernel computes the CRC32C (Castagnoli, seed and result
+ * inverted) of each block and returns it as a little endian uint32_t:
+ * following the data in the registered buffer for PXD_READ_DATA_FIXED,
+ * at pxd_read_data_csum_out.csum for PXD_READ_DATA_CSUM. Set on devices
+ * with checksums enabled through their sysfs checksum attribute.
+ */
+#define PXD_CSUM_SIZE(size) ((size) / PXD_LBS * sizeof(uint32_t))
+
 /** Device identification passed from kernel on initialization */
 struct pxd_dev_id {
 	uint32_t local_minor; 	/**< minor number assigned by kernel */
@@ -177,6 +205,28 @@ struct pxd_read_data_out {
 	uint32_t offset;	/**< offset into data */
 };
 
+/**
+ * PXD_READ_DATA_CSUM request from user space, a PXD_READ_DATA which also
+ * returns the checksum of each block it copies, see PXD_FLAGS_CSUM. The
+ * offset must be block aligned, the checksum of a block which does not
+ * fit the iovecs is not returned.
+ */
+struct pxd_read_data_csum_out {
+	struct pxd_read_data_out rd;
+	uint64_t csum;		/**< user address of the block checksums */
+};
+
+/**
+ * PXD_READ_DATA_FIXED/PXD_REPLY_FIXED request from user space. The data of
+ * the request starts at the beginning of registered buffer buf_index, or
+ * at the offset within the first block for unaligned writes.
+ */
+struct pxd_fixed_data_out {
+	uint64_t unique;	/**< request id */
+	int32_t res;		/**< result code, PXD_REPLY_FIXED only */
+	uint32_t buf_index;	/**< registered buffer index */
+};
+
 /**
  * PXD_UPDATE_SIZE ioctl from user space
  */
@@ -226,11 +276,12 @@ struct pxd_device* find_pxd_device(struct pxd_context *ctx, uint64_t dev_id);
 // No arguments necessary other than opcode
 #define PXD_FEATURE_FASTPATH (0x1)
 #define PXD_FEATURE_ATTACH_OPTIMIZED (0x2)
+#define PXD_FEATURE_CSUM (0x4)
 
 static inline
 int pxd_supported_features(void)
 {
-    int features = PXD_FEATURE_ATTACH_OPTIMIZED;
+    int features = PXD_FEATURE_ATTACH_OPTIMIZED | PXD_FEATURE_CSUM;
 #ifdef __PX_FASTPATH__
     features |= PXD_FEATURE_FASTPATH;
 #endif
@@ -334,6 +385,55 @@ struct pxd_ioctl_init_args {
 	struct pxd_dev_id devices[PXD_MAX_DEVICES];
 };
 
+/**
+ * PXD_IOC_RUN_USER_QUEUE/PXD_IOC_RUN_IO_QUEUE arguments, optional.
+ *
+ * Both process requests posted on the user request queue. RUN_IO_QUEUE then
+ * waits up to timeout_ms for requests on the request queue. The ioctls
+ * return the number of user requests processed and the number of requests
+ * available, respectively.
+ */
+struct pxd_ioctl_run_queue_args {
+	uint32_t max_batch;	/**< max user requests to process, 0 for all */
+	uint32_t timeout_ms;	/**< max time to wait for requests, 0 to not wait */
+	uint32_t processed;	/**< output: number of user requests processed */
+	uint32_t pending;	/**< output: number of requests available */
+};
+
+/**
+ * mmap offset of the io ring queues of a control device, see struct
+ * io_ring_queue.
+ */
+#define PXD_IO_RING_OFFSET	0x40000000ULL
+
+/** PXD_IOC_REGISTER_FILE/PXD_IOC_UNREGISTER_FILE arguments */
+struct pxd_ioctl_register_file_args {
+	int32_t fd;		/**< file descriptor to register */
+	uint32_t index;		/**< index for IOSQE_FIXED_FILE, output of register */
+};
+
+/**
+ * PXD_IOC_REGISTER_BUFFERS arguments. The arena is pinned and split into
+ * len / buf_size buffers, the ioctl returns the number of buffers.
+ */
+struct pxd_ioctl_register_buffers_args {
+	uint64_t addr;		/**< start of the arena, page aligned */
+	uint64_t len;		/**< arena length, multiple of buf_size */
+	uint32_t buf_size;	/**< buffer size, multiple of the page size */
+	uint32_t pad;
+};
+
+/**
+ * PXD_IOC_SET_POLL arguments. Readers of the control device which find no
+ * requests spin for them before going to sleep. The spin time follows the
+ * average time readers waited for requests, up to max_spin_us. Readers do
+ * not spin when the average exceeds max_spin_us, 0 turns spinning off.
+ */
+struct pxd_ioctl_poll_args {
+	uint32_t max_spin_us;	/**< max time to spin for requests */
+	uint32_t pad;
+};
+
 /** sub-actions for PXD_IOC_IO_FLUSHER ioctl */
 enum pxd_io_flusher_action {
 	PXD_IO_FLUSHER_GET = 0,	/**<  check IO FLUSHER state of the process */
@@ -25,6 +25,10 @@ blk_qc_t pxd_bio_make_request_entryfn(struct request_queue *q, struct bio *bio);
 void pxd_bio_make_request_entryfn(struct request_queue *q, struct bio *bio);
 #define BLK_QC_RETVAL
 #endif
+
+struct pxd_qos;
+// submits bios held back by the device limits
+void pxd_bio_qos_dispatch(struct pxd_qos *qos, struct bio *bio);
 #endif
 
 void __pxd_abortfailQ(struct pxd_device *pxd_dev);
@@ -47,6 +51,7 @@ struct fp_root_context {
   struct fp_clone_context *clones; // linked clones
   struct list_head wait;  // wait for resources
   atomic_t nactive;       // num of clones requests currently active
+  bool zeroes;            // all zero write, replicas only zero the range
 };
 
 static inline void fp_root_context_init(struct fp_root_context *fproot) {
@@ -54,6 +59,7 @@ static inline void fp_root_context_init(struct fp_root_context *fproot) {
   fproot->bio = NULL;
   fproot->clones = NULL;
   atomic_set(&fproot->nactive, 0);
+  fproot->zeroes = false;
   INIT_LIST_HEAD(&fproot->wait);
   kthread_init_work(&fproot->work, fp_handle_io);
 }
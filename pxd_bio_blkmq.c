@@ -26,6 +26,9 @@
 #include "pxd_compat.h"
 #include "pxd_core.h"
 
+extern uint32_t pxd_detect_zero_writes;
+extern uint32_t pxd_fastpath_aio;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0) || defined(REQ_PREFLUSH)
 inline bool rq_is_special(struct request *rq) {
         return (req_op(rq) == REQ_OP_DISCARD);
@@ -48,6 +51,7 @@ static void stub_endio(struct bio *bio, int error)
 }
 static void clone_cleanup(struct fp_root_context *fproot);
 static void fp_handle_specialops(struct kthread_work *work);
+static void fp_handle_zeroes(struct kthread_work *work);
 
 static atomic_t nclones;
 static atomic_t nrootbios;
@@ -63,8 +67,11 @@ struct fp_clone_context {
         struct fp_clone_context *clones;
         struct fp_root_context *fproot;
         struct file *file;
+        int replica; // index of file among the device's replicas
+        u64 read_start; // for read balancing, 0 if not a read
         int status;
         struct kthread_work work;
+        struct pxd_kiocb kiocb; // file IO when pxd_fastpath_aio is set
         struct bio clone; // should be last
 };
 
@@ -76,6 +83,8 @@ static inline void fp_clone_context_init(struct fp_clone_context *cc,
         cc->file = file;
         cc->clones = NULL;
         cc->qnum = smp_processor_id(); // not used anymore
+        cc->replica = 0;
+        cc->read_start = 0;
         cc->status = 0;
         // work should get initialized at the point of usage.
 }
@@ -99,7 +108,30 @@ static void pxd_process_fileio(struct kthread_work *work) {
         struct fp_root_context *fproot = clone->bi_private;
         struct pxd_device *pxd_dev = fproot_to_pxd(fproot);
 
-        __do_bio_filebacked(pxd_dev, clone, cc->file);
+        if (fproot->zeroes)
+                __do_bio_zeroes_filebacked(pxd_dev, clone, cc->file);
+        else if (!READ_ONCE(pxd_fastpath_aio) ||
+                 __do_bio_filebacked_async(pxd_dev, clone, cc->file,
+                                           &cc->kiocb))
+                __do_bio_filebacked(pxd_dev, clone, cc->file);
+}
+
+// zero detection as on the slow path, writes with flush semantics keep
+// their data as zeroing a range does not honour them.
+static bool rq_is_zero_write(struct fp_root_context *fproot) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
+        struct request *rq = fproot_to_request(fproot);
+
+        if (!READ_ONCE(pxd_detect_zero_writes) || !blk_rq_bytes(rq))
+                return false;
+        if (req_op(rq) != REQ_OP_WRITE ||
+            (rq->cmd_flags & (REQ_PREFLUSH | REQ_FUA)))
+                return false;
+
+        return fuse_req_data_zero(fproot_to_fuse_request(fproot));
+#else
+        return false;
+#endif
 }
 
 // A private global bio mempool for punting requests bypassing vfs
@@ -404,6 +436,7 @@ static struct bio *clone_root(struct fp_root_context *fproot, int i) {
         cc = container_of(clone_bio, struct fp_clone_context, clone);
 
         fp_clone_context_init(cc, fproot, get_file(fileh));
+        cc->replica = i;
         cc->clones = fproot->clones;
         fproot->clones = cc;
         BUG_ON(!cc->file);
@@ -427,6 +460,8 @@ clone_and_map(struct fp_root_context *fproot) {
         struct request *rq = fproot_to_request(fproot); // orig request
         struct bio *clone;
         struct bio *clonerq[MAX_PXD_BACKING_DEVS] = {NULL, NULL, NULL};
+        struct fp_clone_context *cc;
+        bool read;
         int i, j;
 #ifndef __PX_BLKMQ__
         int r = 0;
@@ -471,6 +506,8 @@ clone_and_map(struct fp_root_context *fproot) {
         }
 #endif
 
+        fproot->zeroes = rq_is_zero_write(fproot);
+
         rc = prep_root_bio(fproot);
         if (rc) {
                 printk("blkmq fastpath: prep_root_bio failing %d\n", rc);
@@ -482,9 +519,16 @@ clone_and_map(struct fp_root_context *fproot) {
                 goto err;
         }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0) || defined(REQ_PREFLUSH)
+        read = (REQ_OP(rq) == REQ_OP_READ);
+#else
+        read = !(REQ_OP(rq) & REQ_WRITE);
+#endif
+
         // prepare clone contexts
         for (i = 0; i < pxd_dev->fp.nfd; i++) {
-                clone = clone_root(fproot, i);
+                clone = clone_root(fproot,
+                                   read ? pxd_read_replica(pxd_dev) : i);
                 if (!clone) {
 #ifndef __PX_BLKMQ__
                         r = -ENOMEM;
@@ -495,12 +539,12 @@ clone_and_map(struct fp_root_context *fproot) {
                 }
 
                 clonerq[i] = clone;
-// if this is read op, then request to one replica is sufficient.
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0) || defined(REQ_PREFLUSH)
-                if (REQ_OP(rq) == REQ_OP_READ) {
-#else
-                if (!(REQ_OP(rq) & REQ_WRITE)) {
-#endif
+                // if this is read op, then request to one replica is
+                // sufficient.
+                if (read) {
+                        cc = container_of(clone, struct fp_clone_context,
+                                          clone);
+                        cc->read_start = pxd_read_start(pxd_dev, cc->replica);
                         i = 1;
                         break;
                 }
@@ -509,8 +553,6 @@ clone_and_map(struct fp_root_context *fproot) {
 
         // all clone setup good, now dispatch request
         for (j = 0; j < i; j++) {
-                struct fp_clone_context *cc;
-
                 clone = clonerq[j];
                 BUG_ON(!clone);
                 cc = container_of(clone, struct fp_clone_context, clone);
@@ -521,6 +563,9 @@ clone_and_map(struct fp_root_context *fproot) {
                         if (rq_is_special(rq)) {
                                 kthread_init_work(&cc->work, fp_handle_specialops);
                                 fastpath_queue_work(&cc->work, false);
+                        } else if (fproot->zeroes) {
+                                kthread_init_work(&cc->work, fp_handle_zeroes);
+                                fastpath_queue_work(&cc->work, false);
                         } else {
                                 SUBMIT_BIO(clone);
                         }
@@ -664,6 +709,33 @@ static void fp_handle_specialops(struct kthread_work *work) {
 	BIO_ENDIO(&cc->clone, r);
 }
 
+// all zero writes, let the replica zero the range, which thin provisioned
+// devices can do without allocating it.
+static void fp_handle_zeroes(struct kthread_work *work) {
+        struct fp_clone_context *cc =
+            container_of(work, struct fp_clone_context, work);
+        struct fp_root_context *fproot = cc->fproot;
+        struct pxd_device *pxd_dev = fproot_to_pxd(fproot);
+        struct request *rq = fproot_to_request(fproot);
+        struct block_device *bdev = get_bdev(cc->file);
+        int r = 0;
+
+        BUG_ON(cc->magic != FP_CLONE_MAGIC);
+        BUG_ON(fproot->magic != FP_ROOT_MAGIC);
+        BUG_ON(pxd_dev->magic != PXD_DEV_MAGIC);
+
+        atomic_inc(&pxd_dev->fp.nio_write_zeroes);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 0, 0)
+        r = blkdev_issue_zeroout(bdev, blk_rq_pos(rq), blk_rq_sectors(rq),
+                                 GFP_NOIO, 0);
+#else
+        r = blkdev_issue_zeroout(bdev, blk_rq_pos(rq), blk_rq_sectors(rq),
+                                 GFP_NOIO);
+#endif
+
+        BIO_ENDIO(&cc->clone, r);
+}
+
 static void _end_clone_bio(struct kthread_work *work)
 {
         struct fp_clone_context *cc =
@@ -702,6 +774,9 @@ static void _end_clone_bio(struct kthread_work *work)
                     BIO_SIZE(bio), bio_segments(bio), (long unsigned int)flags);
         }
 
+        if (cc->read_start)
+                pxd_read_done(pxd_dev, cc->replica, cc->read_start);
+
         // cache status within context
         cc->status = blkrc;
         if (!atomic_dec_and_test(&fproot->nactive)) {
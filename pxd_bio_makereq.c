@@ -24,6 +24,8 @@ struct pxd_io_tracker {
         struct list_head item;       // only HEAD needs this
         atomic_t active;             // only HEAD has refs to all active IO
         struct file *file;
+        int replica;     // index of file among the device's replicas
+        u64 read_start;  // for read balancing, 0 if not a read [HEAD]
 
         unsigned long start; // start time [HEAD]
         struct bio *orig;    // original request bio [HEAD]
@@ -211,7 +213,8 @@ static void __pxd_cleanup_block_io(struct pxd_io_tracker *head) {
 
 static struct pxd_io_tracker *
 __pxd_init_block_replica(struct pxd_device *pxd_dev, struct bio *bio,
-                         struct file *fileh) {
+                         int replica) {
+        struct file *fileh = pxd_dev->fp.file[replica];
         struct bio *clone_bio;
         struct pxd_io_tracker *iot;
         struct block_device *bdev = get_bdev(fileh);
@@ -243,6 +246,8 @@ __pxd_init_block_replica(struct pxd_device *pxd_dev, struct bio *bio,
         iot->start = jiffies;
         atomic_set(&iot->active, 0);
         iot->file = get_file(fileh);
+        iot->replica = replica;
+        iot->read_start = 0;
         INIT_WORK(&iot->wi, pxd_process_fileio);
 
         clone_bio->bi_private = pxd_dev;
@@ -259,18 +264,21 @@ static struct pxd_io_tracker *__pxd_init_block_head(struct pxd_device *pxd_dev,
         struct pxd_io_tracker *repl;
         int index;
 
-        head = __pxd_init_block_replica(pxd_dev, bio, pxd_dev->fp.file[0]);
+        // a read goes to one replica only
+        head = __pxd_init_block_replica(
+            pxd_dev, bio, dir == READ ? pxd_read_replica(pxd_dev) : 0);
         if (!head) {
                 return NULL;
         }
+        if (dir == READ)
+                head->read_start = pxd_read_start(pxd_dev, head->replica);
         pxd_mem_printk("allocated tracker %px, clone bio %px dir %d\n", head,
                        &head->clone, bio_data_dir(bio) == READ);
 
         // initialize the replicas only if the request is non-read
         if (dir != READ) {
                 for (index = 1; index < pxd_dev->fp.nfd; index++) {
-                        repl = __pxd_init_block_replica(
-                            pxd_dev, bio, pxd_dev->fp.file[index]);
+                        repl = __pxd_init_block_replica(pxd_dev, bio, index);
                         if (!repl) {
                                 goto repl_cleanup;
                         }
@@ -514,6 +522,9 @@ static void pxd_complete_io(struct bio *bio, int error)
                     BIO_SIZE(bio), bio_segments(bio), (long unsigned int)flags);
         }
 
+        if (iot->read_start)
+                pxd_read_done(pxd_dev, iot->replica, iot->read_start);
+
         fput(iot->file);
         iot->status = blkrc;
         if (!atomic_dec_and_test(&head->active)) {
@@ -632,6 +643,53 @@ static void pxd_process_io(struct pxd_io_tracker *head) {
         }
 }
 
+static void pxd_bio_dispatch(struct pxd_device *pxd_dev, struct bio *bio,
+                             int rw) {
+        struct pxd_io_tracker *head;
+
+        pxd_check_q_congested(pxd_dev);
+        read_lock(&pxd_dev->fp.suspend_lock);
+        if (!pxd_dev->fp.fastpath) {
+                atomic_inc(&pxd_dev->fp.nslowPath);
+                pxd_reroute_slowpath(pxd_dev->disk->queue, bio);
+                read_unlock(&pxd_dev->fp.suspend_lock);
+                return;
+        }
+
+        head = __pxd_init_block_head(pxd_dev, bio, rw);
+        if (!head) {
+                read_unlock(&pxd_dev->fp.suspend_lock);
+                BIO_ENDIO(bio, -ENOMEM);
+
+                // trivial high memory pressure failing IO
+                return;
+        }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+        head->start = bio_start_io_acct(bio);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) ||                        \
+    (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0) &&                         \
+     defined(bvec_iter_sectors))
+        generic_start_io_acct(pxd_dev->disk->queue, bio_op(bio),
+                              REQUEST_GET_SECTORS(bio), &pxd_dev->disk->part0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
+generic_start_io_acct(bio_data_dir(bio), REQUEST_GET_SECTORS(bio),
+                      &pxd_dev->disk->part0);
+#else
+_generic_start_io_acct(pxd_dev->disk->queue, bio_data_dir(bio),
+                       REQUEST_GET_SECTORS(bio), &pxd_dev->disk->part0);
+#endif
+
+        pxd_process_io(head);
+        read_unlock(&pxd_dev->fp.suspend_lock);
+}
+
+void pxd_bio_qos_dispatch(struct pxd_qos *qos, struct bio *bio) {
+        struct pxd_device *pxd_dev = container_of(qos, struct pxd_device, qos);
+
+        pxd_bio_dispatch(pxd_dev, bio, bio_data_dir(bio));
+}
+
 /* fast path make request function, io entry point */
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
 #define BLK_QC_RETVAL BLK_QC_T_NONE
@@ -650,7 +708,6 @@ void pxd_bio_make_request_entryfn(struct request_queue *q, struct bio *bio)
         struct pxd_device *pxd_dev = q->queuedata;
 #endif
         int rw = bio_data_dir(bio);
-        struct pxd_io_tracker *head;
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 8, 0)
         if (!pxd_dev) {
@@ -746,42 +803,11 @@ void pxd_bio_make_request_entryfn(struct request_queue *q, struct bio *bio)
 }
 #endif
 
-        pxd_check_q_congested(pxd_dev);
-        read_lock(&pxd_dev->fp.suspend_lock);
-        if (!pxd_dev->fp.fastpath) {
-                atomic_inc(&pxd_dev->fp.nslowPath);
-                pxd_reroute_slowpath(q, bio);
-                read_unlock(&pxd_dev->fp.suspend_lock);
-                return BLK_QC_RETVAL;
-        }
-
-        head = __pxd_init_block_head(pxd_dev, bio, rw);
-        if (!head) {
-                read_unlock(&pxd_dev->fp.suspend_lock);
-                BIO_ENDIO(bio, -ENOMEM);
-
-                // trivial high memory pressure failing IO
+        // over the device limits, the bio is submitted once tokens are available
+        if (pxd_qos_queue_bio(&pxd_dev->qos, bio))
                 return BLK_QC_RETVAL;
-        }
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
-        head->start = bio_start_io_acct(bio);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) ||                        \
-    (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0) &&                         \
-     defined(bvec_iter_sectors))
-        generic_start_io_acct(pxd_dev->disk->queue, bio_op(bio),
-                              REQUEST_GET_SECTORS(bio), &pxd_dev->disk->part0);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3, 19, 0)
-generic_start_io_acct(bio_data_dir(bio), REQUEST_GET_SECTORS(bio),
-                      &pxd_dev->disk->part0);
-#else
-_generic_start_io_acct(pxd_dev->disk->queue, bio_data_dir(bio),
-                       REQUEST_GET_SECTORS(bio), &pxd_dev->disk->part0);
-#endif
-
-        pxd_process_io(head);
-        read_unlock(&pxd_dev->fp.suspend_lock);
 
+        pxd_bio_dispatch(pxd_dev, bio, rw);
         return BLK_QC_RETVAL;
 }
 
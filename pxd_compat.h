@@ -192,4 +192,73 @@ static inline void bio_set_op_attrs(struct bio *bio, enum req_op op,
 } while (0)
 #endif
 
+#ifndef smp_load_acquire
+#define smp_load_acquire(p) ({			\
+	typeof(*(p)) ___v = ACCESS_ONCE(*(p));	\
+	smp_mb();				\
+	___v;					\
+})
+#define smp_store_release(p, v) do {		\
+	smp_mb();				\
+	ACCESS_ONCE(*(p)) = (v);		\
+} while (0)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+#define IOV_ITER_BVEC(i, dir, bvec, nr, count) \
+	iov_iter_bvec(i, dir, bvec, nr, count)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+#define IOV_ITER_BVEC(i, dir, bvec, nr, count) \
+	iov_iter_bvec(i, ITER_BVEC | (dir), bvec, nr, count)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+#define VFS_ITER_READ(file, i, pos)	vfs_iter_read(file, i, pos, 0)
+#define VFS_ITER_WRITE(file, i, pos)	vfs_iter_write(file, i, pos, 0)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+#define VFS_ITER_READ(file, i, pos)	vfs_iter_read(file, i, pos)
+#define VFS_ITER_WRITE(file, i, pos)	vfs_iter_write(file, i, pos)
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,6,0)
+#define PIN_USER_PAGES_FAST(start, nr, pages) \
+	pin_user_pages_fast(start, nr, FOLL_WRITE | FOLL_LONGTERM, pages)
+#define UNPIN_USER_PAGE(page)	unpin_user_page(page)
+#else
+/* FOLL_WRITE doubles as the 'write' argument before 5.2 */
+#define PIN_USER_PAGES_FAST(start, nr, pages) \
+	get_user_pages_fast(start, nr, FOLL_WRITE, pages)
+#define UNPIN_USER_PAGE(page)	put_page(page)
+#endif
+
+/* mm->pinned_vm is an atomic counter from 5.1, before mmap_sem guards it */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,1,0)
+#define MM_PINNED_ADD(mm, nr)	atomic64_add_return(nr, &(mm)->pinned_vm)
+#define MM_PINNED_SUB(mm, nr)	atomic64_sub(nr, &(mm)->pinned_vm)
+#else
+static inline u64 MM_PINNED_ADD(struct mm_struct *mm, u64 nr)
+{
+	u64 pinned;
+
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm += nr;
+	pinned = mm->pinned_vm;
+	up_write(&mm->mmap_sem);
+	return pinned;
+}
+
+static inline void MM_PINNED_SUB(struct mm_struct *mm, u64 nr)
+{
+	down_write(&mm->mmap_sem);
+	mm->pinned_vm -= nr;
+	up_write(&mm->mmap_sem);
+}
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define MMGRAB(mm)	mmgrab(mm)
+#else
+#define MMGRAB(mm)	atomic_inc(&(mm)->mm_count)
+#endif
+
 #endif //GDFS_PXD_COMPAT_H
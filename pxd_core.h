@@ -10,6 +10,8 @@
 
 #include "pxd_fastpath.h"
 #include "fuse_i.h"
+#include "pxd_io_uring.h"
+#include "pxd_qos.h"
 
 struct pxd_context {
 	spinlock_t lock;
@@ -21,6 +23,7 @@ struct pxd_context {
 	int id;
 	struct miscdevice miscdev;
 	struct delayed_work abort_work;
+	struct pxd_io_ring io_ring;
 
 	uint64_t open_seq;
 };
@@ -58,6 +61,11 @@ struct pxd_device {
 	unsigned int nr_congestion_on;
 	unsigned int nr_congestion_off;
 
+	// IOPS and bandwidth limits
+	struct pxd_qos qos;
+
+	bool csum; // sysfs attribute, return block checksums of writes
+
 	struct work_struct remove_work;
 
 	wait_queue_head_t remove_wait;
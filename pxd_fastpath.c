@@ -382,6 +382,17 @@ int pxd_request_resume(struct pxd_device *pxd_dev)
 	return rc;
 }
 
+// a file (re)opened needs an fsync on the next flush and starts without
+// the error of a failed fsync of the file it replaces.
+static void pxd_flush_seq_reset(struct pxd_flush_seq *seq)
+{
+	mutex_lock(&seq->lock);
+	atomic64_inc(&seq->write_epoch);
+	seq->err_epoch = 0;
+	seq->err = 0;
+	mutex_unlock(&seq->lock);
+}
+
 /*
  * shall get called last when new device is added/updated or when fuse connection is lost
  * and re-estabilished.
@@ -445,6 +456,10 @@ void enableFastPath(struct pxd_device *pxd_dev, bool force)
 		}
 	}
 
+	// reopened files, and writes done by px-storage while the fastpath
+	// was off, are not covered by any fsync counted so far
+	for (i = 0; i < MAX_PXD_BACKING_DEVS; i++)
+		pxd_flush_seq_reset(&fp->flushseq[i]);
 	pxd_dev->fp.fastpath = true;
 	pxd_resume_io(pxd_dev);
 
@@ -543,6 +558,14 @@ int pxd_fastpath_init(struct pxd_device *pxd_dev)
 		fp->syncwi[i].index = i;
 		fp->syncwi[i].pxd_dev = pxd_dev;
 		fp->syncwi[i].rc = 0;
+		mutex_init(&fp->flushseq[i].lock);
+		atomic64_set(&fp->flushseq[i].write_epoch, 0);
+		atomic64_set(&fp->flushseq[i].flush_epoch, 0);
+		fp->flushseq[i].err_epoch = 0;
+		fp->flushseq[i].err = 0;
+		atomic_set(&fp->rstats[i].inflight, 0);
+		atomic_set(&fp->rstats[i].nreads, 0);
+		atomic64_set(&fp->rstats[i].ewma_ns, 0);
 	}
 
 	// failover init
@@ -554,9 +577,11 @@ int pxd_fastpath_init(struct pxd_device *pxd_dev)
 	atomic_set(&fp->nio_discard, 0);
 	atomic_set(&fp->nio_flush, 0);
 	atomic_set(&fp->nio_flush_nop, 0);
+	atomic_set(&fp->nio_flush_coalesced, 0);
 	atomic_set(&fp->nio_preflush, 0);
 	atomic_set(&fp->nio_fua, 0);
 	atomic_set(&fp->nio_write, 0);
+	atomic_set(&fp->nio_write_zeroes, 0);
 	atomic_set(&fp->nswitch,0);
 	atomic_set(&fp->nslowPath,0);
 	atomic_set(&pxd_dev->fp.ncomplete, 0);
@@ -600,6 +625,7 @@ int pxd_init_fastpath_target(struct pxd_device *pxd_dev, struct pxd_update_path_
 	}
 	pxd_dev->fp.nfd = update_path->count;
 	pxd_dev->fp.can_failover = update_path->can_failover;
+	pxd_flush_seq_invalidate(&pxd_dev->fp);
 	enableFastPath(pxd_dev, true);
 	pxd_resume_io(pxd_dev);
 
@@ -696,8 +722,7 @@ void pxd_fastpath_reset_device(struct pxd_device *pxd_dev)
 		if (!IS_ERR_OR_NULL(req)) {
 			// overwrite switch request to fail all pending IOs
 			req->in.h.opcode = PXD_FAILOVER_TO_USERSPACE;
-			req->out.h.error = -EIO; // force failure status
-			request_end(fc, req, true /* should lock */);
+			fuse_request_cancel(fc, req, -EIO); // force failure status
 		} else {
 			pxd_dev->fp.switch_uid = 0;
 			atomic_set(&fp->ioswitch_active, 0);
@@ -759,6 +784,59 @@ unsigned int balanceIO(struct pxfpcontext_per_node *c, unsigned int cpuid, bool
 	return 0; // not possible case
 }
 
+int pxd_read_replica(struct pxd_device *pxd_dev)
+{
+	struct pxd_fastpath_extension *fp = &pxd_dev->fp;
+	int policy = READ_ONCE(fp->read_policy);
+	int nfd = READ_ONCE(fp->nfd);
+	u64 score, best_score = U64_MAX;
+	int start, best, i, r;
+
+	if (nfd <= 1 || policy == PXD_READ_FIRST)
+		return 0;
+
+	// with a rotating start ties are spread across replicas
+	start = (unsigned int)atomic_inc_return(&fp->read_next) % nfd;
+	if (policy == PXD_READ_ROUND_ROBIN)
+		return start;
+
+	best = start;
+	for (i = 0; i < nfd; i++) {
+		r = (start + i) % nfd;
+		score = atomic_read(&fp->rstats[r].inflight) + 1;
+		// replicas not read from yet have no average and are tried
+		if (policy == PXD_READ_LATENCY)
+			score *= max_t(s64, atomic64_read(&fp->rstats[r].ewma_ns), 1);
+		if (score < best_score) {
+			best_score = score;
+			best = r;
+		}
+	}
+	return best;
+}
+
+u64 pxd_read_start(struct pxd_device *pxd_dev, int replica)
+{
+	struct pxd_read_stats *rs = &pxd_dev->fp.rstats[replica];
+
+	atomic_inc(&rs->inflight);
+	atomic_inc(&rs->nreads);
+	return ktime_to_ns(ktime_get());
+}
+
+void pxd_read_done(struct pxd_device *pxd_dev, int replica, u64 start)
+{
+	struct pxd_read_stats *rs = &pxd_dev->fp.rstats[replica];
+	s64 lat = ktime_to_ns(ktime_get()) - start;
+	s64 avg = atomic64_read(&rs->ewma_ns);
+
+	// racing updates may lose a sample, the average is only a hint
+	if (avg)
+		lat = avg + (lat - avg) / PXD_READ_EWMA_WEIGHT;
+	atomic64_set(&rs->ewma_ns, max_t(s64, lat, 1));
+	atomic_dec(&rs->inflight);
+}
+
 // assign work on the worker thread with least penalty. loadbalance
 // across threads if no hint provided through 'qnum'
 void fastpath_queue_work(struct kthread_work* work, bool completion)
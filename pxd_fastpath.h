@@ -2,6 +2,7 @@
 #define _PXD_FASTPATH_H_
 
 #include <linux/atomic.h>
+#include <linux/mutex.h>
 #include <linux/blkdev.h>
 #include <linux/uio.h>
 #include <linux/kthread.h>
@@ -26,6 +27,37 @@ struct pxd_sync_ws {
 	int rc; // result
 };
 
+// orders the fsyncs of a file replica. writes completed are counted, a
+// flush needs an fsync started after the count it sampled. flushes arriving
+// during an fsync wait for it and are then all covered by the next one.
+// this only holds while every write to the file goes through kiolib, any
+// other way data reaches the file must call pxd_flush_seq_invalidate().
+struct pxd_flush_seq {
+	struct mutex lock;
+	atomic64_t write_epoch; // writes completed
+	atomic64_t flush_epoch; // writes covered by the last good fsync
+	s64 err_epoch; // writes covered by the last failed fsync, under lock
+	int err;
+};
+
+// how a read picks the one replica it goes to
+enum pxd_read_policy {
+	PXD_READ_FIRST, // always the first replica
+	PXD_READ_ROUND_ROBIN,
+	PXD_READ_LEAST_BUSY, // fewest reads outstanding
+	PXD_READ_LATENCY, // average latency weighted by reads outstanding
+	PXD_READ_NR_POLICIES,
+};
+
+// weight of a new sample in the read latency average, 1/N
+#define PXD_READ_EWMA_WEIGHT (8)
+
+struct pxd_read_stats {
+	atomic_t inflight; // reads outstanding
+	atomic_t nreads; // reads issued
+	atomic64_t ewma_ns; // moving average of read latency
+};
+
 struct pxd_fastpath_extension {
 	// Extended information
 	atomic_t ioswitch_active; // failover or fallback active
@@ -58,6 +90,14 @@ struct pxd_fastpath_extension {
 	atomic_t nio_flush_nop;
 	atomic_t nio_fua;
 	atomic_t nio_write;
+	atomic_t nio_write_zeroes;
+	atomic_t nio_flush_coalesced; // flushes covered by another's fsync
+
+	struct pxd_flush_seq flushseq[MAX_PXD_BACKING_DEVS];
+
+	int read_policy; // enum pxd_read_policy
+	atomic_t read_next; // rotates the replica reads start from
+	struct pxd_read_stats rstats[MAX_PXD_BACKING_DEVS];
 
 	atomic_t nswitch; // [global] total number of requests through bio switch path
 	atomic_t nslowPath; // [global] total requests through slow path
@@ -65,6 +105,17 @@ struct pxd_fastpath_extension {
 	atomic_t nerror; // [global] total IO error
 };
 
+// data reached the replicas other than through kiolib, by px-storage on
+// the slowpath or in a file just (re)opened. the next flush of each
+// replica has to fsync.
+static inline void pxd_flush_seq_invalidate(struct pxd_fastpath_extension *fp)
+{
+	int i;
+
+	for (i = 0; i < MAX_PXD_BACKING_DEVS; i++)
+		atomic64_inc(&fp->flushseq[i].write_epoch);
+}
+
 #ifndef __PX_FASTPATH__
 #include "pxd_fastpath_stub.h"
 #else
@@ -88,6 +139,12 @@ void disableFastPath(struct pxd_device *pxd_dev, bool skipSync);
 // congestion
 int pxd_device_congested(void *, int);
 
+// read balancing across replicas, pxd_read_start() returns the time
+// to pass to pxd_read_done() once the read completes.
+int pxd_read_replica(struct pxd_device *pxd_dev);
+u64 pxd_read_start(struct pxd_device *pxd_dev, int replica);
+void pxd_read_done(struct pxd_device *pxd_dev, int replica, u64 start);
+
 // return the io count processed by a thread
 int get_thread_count(int id);
 
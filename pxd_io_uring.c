@@ -0,0 +1,425 @@
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/highmem.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/blkdev.h>
+
+#include "pxd_compat.h"
+#include "pxd_core.h"
+#include "pxd_io_uring.h"
+
+#define PXD_IO_RING_MASK (FUSE_REQUEST_QUEUE_SIZE - 1)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,0,0)
+#define PXD_IO_RING_BIO_OPS
+
+/* iterate over the data segments of a request */
+#ifdef __PXD_BIO_MAKEREQ__
+typedef struct bvec_iter pxd_seg_iter;
+#define pxd_req_for_each_segment(bvec, req, iter) \
+	bio_for_each_segment(bvec, (req)->bio, iter)
+#else
+typedef struct req_iterator pxd_seg_iter;
+#define pxd_req_for_each_segment(bvec, req, iter) \
+	rq_for_each_segment(bvec, (req)->rq, iter)
+#endif
+#endif
+
+void pxd_io_ring_init(struct pxd_io_ring *ring)
+{
+	memset(ring, 0, sizeof(*ring));
+	mutex_init(&ring->lock);
+}
+
+void pxd_io_ring_destroy(struct pxd_io_ring *ring)
+{
+	pxd_io_ring_unregister_files(ring);
+	if (ring->queue)
+		vfree(ring->queue);
+	ring->queue = NULL;
+}
+
+static void pxd_io_ring_reset_cb(struct fuse_queue_cb *cb)
+{
+	cb->w.write = 0;
+	cb->w.read = 0;
+	cb->w.sequence = 0;
+
+	cb->r.read = 0;
+	cb->r.write = 0;
+	cb->r.need_wake_up = 0;
+}
+
+void pxd_io_ring_reset(struct pxd_io_ring *ring)
+{
+	mutex_lock(&ring->lock);
+	if (ring->queue) {
+		pxd_io_ring_reset_cb(&ring->queue->requests_cb);
+		pxd_io_ring_reset_cb(&ring->queue->responses_cb);
+	}
+	mutex_unlock(&ring->lock);
+}
+
+int pxd_io_ring_mmap(struct pxd_io_ring *ring, struct vm_area_struct *vma)
+{
+	int rc;
+
+	mutex_lock(&ring->lock);
+	if (!ring->queue) {
+		ring->queue = vmalloc_user(sizeof(struct io_ring_queue));
+		if (!ring->queue) {
+			rc = -ENOMEM;
+			goto out;
+		}
+	}
+
+	rc = remap_vmalloc_range(vma, ring->queue, 0);
+	if (rc)
+		printk(KERN_ERR "%s: map io ring failed: %d\n", __func__, rc);
+out:
+	mutex_unlock(&ring->lock);
+	return rc;
+}
+
+int pxd_io_ring_register_file(struct pxd_io_ring *ring, int fd)
+{
+	struct file *file = fget(fd);
+	int i;
+
+	if (!file)
+		return -EBADF;
+
+	mutex_lock(&ring->lock);
+	for (i = 0; i < PXD_IO_RING_MAX_FILES; ++i) {
+		if (!ring->files[i]) {
+			ring->files[i] = file;
+			break;
+		}
+	}
+	mutex_unlock(&ring->lock);
+
+	if (i == PXD_IO_RING_MAX_FILES) {
+		fput(file);
+		return -EMFILE;
+	}
+
+	return i;
+}
+
+int pxd_io_ring_unregister_file(struct pxd_io_ring *ring, u32 index)
+{
+	struct file *file;
+
+	if (index >= PXD_IO_RING_MAX_FILES)
+		return -EINVAL;
+
+	mutex_lock(&ring->lock);
+	file = ring->files[index];
+	ring->files[index] = NULL;
+	mutex_unlock(&ring->lock);
+
+	if (!file)
+		return -EBADF;
+
+	fput(file);
+	return 0;
+}
+
+void pxd_io_ring_unregister_files(struct pxd_io_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < PXD_IO_RING_MAX_FILES; ++i)
+		pxd_io_ring_unregister_file(ring, i);
+}
+
+/* Called with ring->lock held, registered files need no reference */
+static struct file *pxd_io_ring_get_file(struct pxd_io_ring *ring,
+		const struct io_uring_sqe *sqe)
+{
+	if (sqe->flags & IOSQE_FIXED_FILE) {
+		if ((u32)sqe->fd >= PXD_IO_RING_MAX_FILES)
+			return NULL;
+		return ring->files[sqe->fd];
+	}
+
+	return fget(sqe->fd);
+}
+
+static void pxd_io_ring_put_file(const struct io_uring_sqe *sqe,
+		struct file *file)
+{
+	if (!(sqe->flags & IOSQE_FIXED_FILE))
+		fput(file);
+}
+
+#ifdef PXD_IO_RING_BIO_OPS
+/*
+ * Read or write the payload of a request from or to @file at @pos. A short
+ * read zero fills the rest of the payload.
+ */
+static ssize_t pxd_io_ring_file_rw(struct fuse_req *req, struct file *file,
+		loff_t pos, bool write)
+{
+	struct bio_vec bvec;
+	pxd_seg_iter iter;
+	struct iov_iter i;
+	ssize_t done = 0;
+	ssize_t rc;
+	bool eof = false;
+
+	if (write)
+		file_start_write(file);
+
+	pxd_req_for_each_segment(bvec, req, iter) {
+		if (eof) {
+			zero_user(bvec.bv_page, bvec.bv_offset, bvec.bv_len);
+			done += bvec.bv_len;
+			continue;
+		}
+
+		IOV_ITER_BVEC(&i, write ? WRITE : READ, &bvec, 1, bvec.bv_len);
+		if (write)
+			rc = VFS_ITER_WRITE(file, &i, &pos);
+		else
+			rc = VFS_ITER_READ(file, &i, &pos);
+		if (rc < 0) {
+			done = rc;
+			break;
+		}
+
+		if (rc != bvec.bv_len) {
+			if (write) {
+				done = -EIO;
+				break;
+			}
+			zero_user(bvec.bv_page, bvec.bv_offset + rc,
+				  bvec.bv_len - rc);
+			eof = true;
+		}
+		done += bvec.bv_len;
+	}
+
+	if (write)
+		file_end_write(file);
+
+	return done;
+}
+
+static ssize_t pxd_io_ring_bio(struct pxd_io_ring *ring, struct fuse_conn *fc,
+		const struct io_uring_sqe *sqe, bool write)
+{
+	struct fuse_req *req;
+	struct file *file;
+	ssize_t rc;
+
+	/* the request is not finished under the I/O to its pages */
+	req = fuse_request_hold(fc, sqe->addr);
+	if (!req)
+		return -ENOENT;
+
+	if (req->in.h.opcode != (write ? PXD_WRITE : PXD_READ) ||
+	    (sqe->len && sqe->len != req->pxd_rdwr_in.size)) {
+		rc = -EINVAL;
+		goto out;
+	}
+
+	file = pxd_io_ring_get_file(ring, sqe);
+	if (!file) {
+		rc = -EBADF;
+		goto out;
+	}
+
+	rc = pxd_io_ring_file_rw(req, file, sqe->off, write);
+	pxd_io_ring_put_file(sqe, file);
+out:
+	fuse_request_unhold(req);
+	return rc;
+}
+
+/*
+ * Copy the payload of a write request to the user buffer, or the user
+ * buffer to the payload of a read request.
+ */
+static ssize_t pxd_io_ring_copy_data(struct fuse_conn *fc,
+		const struct io_uring_sqe *sqe)
+{
+	struct iovec iov;
+	struct iov_iter data_iter;
+	struct fuse_req *req;
+	struct bio_vec bvec;
+	pxd_seg_iter iter;
+	ssize_t done = 0;
+	size_t copied;
+	bool to_user;
+	int rc;
+
+	/* the request is not finished under the copy to its pages */
+	req = fuse_request_hold(fc, sqe->off);
+	if (!req)
+		return -ENOENT;
+
+	if (req->in.h.opcode == PXD_WRITE)
+		to_user = true;
+	else if (req->in.h.opcode == PXD_READ)
+		to_user = false;
+	else {
+		done = -EINVAL;
+		goto out;
+	}
+
+	if (sqe->flags & IOSQE_FIXED_BUFFER) {
+		rc = fuse_get_buffer(fc, sqe->buf_index, to_user ? READ : WRITE,
+				sqe->len, &data_iter);
+		if (rc) {
+			done = rc;
+			goto out;
+		}
+	} else {
+		iov.iov_base = (void __user *)(uintptr_t)sqe->addr;
+		iov.iov_len = sqe->len;
+		iov_iter_init(&data_iter, to_user ? READ : WRITE, &iov, 1,
+				sqe->len);
+	}
+
+	pxd_req_for_each_segment(bvec, req, iter) {
+		if (to_user)
+			copied = copy_page_to_iter(bvec.bv_page, bvec.bv_offset,
+					bvec.bv_len, &data_iter);
+		else
+			copied = copy_page_from_iter(bvec.bv_page, bvec.bv_offset,
+					bvec.bv_len, &data_iter);
+		done += copied;
+		if (copied != bvec.bv_len) {
+			/* buffer exhausted, anything else is a fault */
+			if (iov_iter_count(&data_iter))
+				done = -EFAULT;
+			break;
+		}
+	}
+
+	if (sqe->flags & IOSQE_FIXED_BUFFER)
+		fuse_put_buffer(fc);
+out:
+	fuse_request_unhold(req);
+	return done;
+}
+#endif
+
+static int pxd_io_ring_discard(struct pxd_io_ring *ring,
+		const struct io_uring_sqe *sqe)
+{
+	int mode = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+	struct file *file;
+	int rc;
+
+	file = pxd_io_ring_get_file(ring, sqe);
+	if (!file)
+		return -EBADF;
+
+	rc = vfs_fallocate(file, mode, sqe->off, sqe->len);
+	pxd_io_ring_put_file(sqe, file);
+
+	return rc;
+}
+
+static int pxd_io_ring_fsync(struct pxd_io_ring *ring,
+		const struct io_uring_sqe *sqe)
+{
+	struct file *file;
+	int rc;
+
+	file = pxd_io_ring_get_file(ring, sqe);
+	if (!file)
+		return -EBADF;
+
+	rc = vfs_fsync(file, sqe->fsync_flags & IORING_FSYNC_DATASYNC);
+	pxd_io_ring_put_file(sqe, file);
+
+	return rc;
+}
+
+static s32 pxd_io_ring_submit(struct pxd_io_ring *ring, struct fuse_conn *fc,
+		const struct io_uring_sqe *sqe)
+{
+	switch (sqe->opcode) {
+	case IORING_OP_NOP:
+		return 0;
+#ifdef PXD_IO_RING_BIO_OPS
+	case IORING_OP_READ_BIO:
+		return pxd_io_ring_bio(ring, fc, sqe, false);
+	case IORING_OP_WRITE_BIO:
+		return pxd_io_ring_bio(ring, fc, sqe, true);
+	case IORING_OP_COPY_DATA:
+		return pxd_io_ring_copy_data(fc, sqe);
+#endif
+	case IORING_OP_DISCARD_FIXED:
+		return pxd_io_ring_discard(ring, sqe);
+	case IORING_OP_SYNCFS_FIXED:
+		return pxd_io_ring_fsync(ring, sqe);
+	default:
+		return -EOPNOTSUPP;
+	}
+}
+
+int pxd_io_ring_run(struct pxd_io_ring *ring, struct fuse_conn *fc, u32 max)
+{
+	struct io_ring_queue *queue;
+	struct fuse_queue_cb *sq, *cq;
+	struct io_uring_sqe sqe;
+	struct io_uring_cqe *cqe;
+	u32 read, write;
+	u32 cq_read, cq_write, cq_next;
+	int count = 0;
+
+	mutex_lock(&ring->lock);
+	queue = ring->queue;
+	if (!queue) {
+		mutex_unlock(&ring->lock);
+		return 0;
+	}
+
+	sq = &queue->requests_cb;
+	cq = &queue->responses_cb;
+
+	read = READ_ONCE(sq->r.read) & PXD_IO_RING_MASK;
+	/* pairs with the release of the write index by user space */
+	write = smp_load_acquire(&sq->r.write) & PXD_IO_RING_MASK;
+	cq_write = READ_ONCE(cq->w.write) & PXD_IO_RING_MASK;
+	cq_read = READ_ONCE(cq->w.read) & PXD_IO_RING_MASK;
+
+	while (read != write && (!max || count < max)) {
+		cq_next = (cq_write + 1) & PXD_IO_RING_MASK;
+		if (cq_next == cq_read) {
+			cq_read = smp_load_acquire(&cq->r.read) &
+				PXD_IO_RING_MASK;
+			if (cq_next == cq_read)
+				break;
+		}
+
+		/* user space owns the entry, work on a private copy */
+		sqe = queue->requests[read];
+		read = (read + 1) & PXD_IO_RING_MASK;
+
+		cqe = &queue->responses[cq_write];
+		cqe->user_data = sqe.user_data;
+		cqe->res = pxd_io_ring_submit(ring, fc, &sqe);
+		cqe->flags = 0;
+		cq_write = cq_next;
+		++count;
+
+		if (read == write)
+			write = smp_load_acquire(&sq->r.write) &
+				PXD_IO_RING_MASK;
+	}
+
+	cq->w.write = cq_write;
+	cq->w.read = cq_read;
+	smp_store_release(&sq->r.read, read);
+	smp_store_release(&cq->r.write, cq_write);
+	mutex_unlock(&ring->lock);
+
+	return count;
+}
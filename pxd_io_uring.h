@@ -42,6 +42,7 @@ struct io_uring_sqe {
 #define IOSQE_FIXED_FILE	(1U << 0)	/* use fixed fileset */
 #define IOSQE_IO_DRAIN		(1U << 1)	/* issue after inflight IO */
 #define IOSQE_FORCE_ASYNC	(1U << 2)	/* force async i/o even if opened direct */
+#define IOSQE_FIXED_BUFFER	(1U << 3)	/* use registered buffer buf_index */
 
 /*
  * io_uring_setup() flags
@@ -66,6 +67,24 @@ struct io_uring_sqe {
 #define IORING_OP_READ_BIO  13
 #define IORING_OP_WRITE_BIO 14
 
+/*
+ * Operations on pending pxd requests, executed by PXD_IOC_RUN_IO_QUEUE:
+ *
+ * READ_BIO	read a PXD_READ request payload from fd at off, addr is the
+ *		request unique id, len is 0 or the request size
+ * WRITE_BIO	write a PXD_WRITE request payload to fd at off, addr and len
+ *		as for READ_BIO
+ * COPY_DATA	copy a request payload to (PXD_WRITE) or from (PXD_READ) the
+ *		user buffer at addr of len bytes, off is the request unique id.
+ *		With IOSQE_FIXED_BUFFER registered buffer buf_index is used
+ *		instead of addr.
+ * DISCARD_FIXED	punch a hole of len bytes at off in fd
+ * SYNCFS_FIXED	fsync fd, honours IORING_FSYNC_DATASYNC
+ *
+ * fd is an index into the registered files with IOSQE_FIXED_FILE. The
+ * result is the number of bytes transferred or a negative error.
+ */
+
 /*
  * sqe->fsync_flags
  */
@@ -157,4 +176,41 @@ struct io_ring_queue {
 	struct io_uring_cqe responses[FUSE_REQUEST_QUEUE_SIZE];
 };
 
+/** maximum number of registered files */
+#define PXD_IO_RING_MAX_FILES 256
+
+/*
+ * In kernel io engine of a control device. Submissions on the mapped
+ * io_ring_queue are processed by PXD_IOC_RUN_IO_QUEUE.
+ */
+struct pxd_io_ring {
+	/** serializes submission processing and file registration */
+	struct mutex lock;
+
+	/** queues shared with user space, allocated on first mmap */
+	struct io_ring_queue *queue;
+
+	/** registered files, used with IOSQE_FIXED_FILE */
+	struct file *files[PXD_IO_RING_MAX_FILES];
+};
+
+void pxd_io_ring_init(struct pxd_io_ring *ring);
+void pxd_io_ring_destroy(struct pxd_io_ring *ring);
+
+/** Reset queue indices, called when the control device is opened */
+void pxd_io_ring_reset(struct pxd_io_ring *ring);
+
+int pxd_io_ring_mmap(struct pxd_io_ring *ring, struct vm_area_struct *vma);
+
+/** Returns the index of the registered file or a negative error */
+int pxd_io_ring_register_file(struct pxd_io_ring *ring, int fd);
+int pxd_io_ring_unregister_file(struct pxd_io_ring *ring, u32 index);
+void pxd_io_ring_unregister_files(struct pxd_io_ring *ring);
+
+/**
+ * Process up to @max submissions, all of them if @max is zero. Stops
+ * early if the completion queue is full. Returns the number processed.
+ */
+int pxd_io_ring_run(struct pxd_io_ring *ring, struct fuse_conn *fc, u32 max);
+
 #endif
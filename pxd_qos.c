@@ -0,0 +1,273 @@
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/ktime.h>
+#include <linux/jiffies.h>
+#include <linux/version.h>
+#include <linux/blkdev.h>
+
+#include "pxd_compat.h"
+#include "pxd_qos.h"
+
+/* keeps a full bucket, rate * PXD_QOS_BURST_MS in usecs, within s64 */
+#define PXD_QOS_MAX_RATE	(1ULL << 40)
+
+static const char * const pxd_qos_names[PXD_QOS_NR_LIMITS] = {
+	[PXD_QOS_READ_IOPS] = "riops",
+	[PXD_QOS_WRITE_IOPS] = "wiops",
+	[PXD_QOS_READ_BPS] = "rbps",
+	[PXD_QOS_WRITE_BPS] = "wbps",
+};
+
+static s64 pxd_qos_capacity(struct pxd_qos_bucket *b)
+{
+	return b->rate * PXD_QOS_BURST_MS * USEC_PER_MSEC;
+}
+
+/* Add the tokens accrued since the last refill, called with qos->lock held */
+static void pxd_qos_refill(struct pxd_qos *qos)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	u64 elapsed = div_u64(now - qos->last, NSEC_PER_USEC);
+	struct pxd_qos_bucket *b;
+	int i;
+
+	if (!elapsed)
+		return;
+
+	/* carry the fraction of a usec over to the next refill */
+	qos->last += elapsed * NSEC_PER_USEC;
+	elapsed = min_t(u64, elapsed, PXD_QOS_BURST_MS * USEC_PER_MSEC);
+	for (i = 0; i < PXD_QOS_NR_LIMITS; ++i) {
+		b = &qos->buckets[i];
+		if (b->rate)
+			b->tokens = min_t(s64, b->tokens + elapsed * b->rate,
+				pxd_qos_capacity(b));
+	}
+}
+
+/* Nanoseconds until the bucket is out of debt */
+static u64 pxd_qos_bucket_wait(struct pxd_qos_bucket *b)
+{
+	if (!b->rate || b->tokens > 0)
+		return 0;
+	return div64_u64((u64)-b->tokens + b->rate, b->rate) * NSEC_PER_USEC;
+}
+
+static u64 __pxd_qos_charge(struct pxd_qos *qos, bool write, u32 bytes)
+{
+	struct pxd_qos_bucket *iops =
+		&qos->buckets[write ? PXD_QOS_WRITE_IOPS : PXD_QOS_READ_IOPS];
+	struct pxd_qos_bucket *bps =
+		&qos->buckets[write ? PXD_QOS_WRITE_BPS : PXD_QOS_READ_BPS];
+	u64 wait;
+
+	pxd_qos_refill(qos);
+	wait = max(pxd_qos_bucket_wait(iops), pxd_qos_bucket_wait(bps));
+	if (wait) {
+		qos->nr_throttled++;
+		/* limits may be raised meanwhile, look again at least every second */
+		return min_t(u64, wait, NSEC_PER_SEC);
+	}
+
+	if (iops->rate)
+		iops->tokens -= USEC_PER_SEC;
+	if (bps->rate)
+		bps->tokens -= (s64)bytes * USEC_PER_SEC;
+	return 0;
+}
+
+u64 pxd_qos_charge(struct pxd_qos *qos, bool write, u32 bytes)
+{
+	unsigned long flags;
+	u64 wait;
+
+	if (!pxd_qos_enabled(qos))
+		return 0;
+
+	spin_lock_irqsave(&qos->lock, flags);
+	wait = __pxd_qos_charge(qos, write, bytes);
+	spin_unlock_irqrestore(&qos->lock, flags);
+
+	return wait;
+}
+
+static unsigned long pxd_qos_jiffies(u64 wait)
+{
+	return max_t(unsigned long,
+		usecs_to_jiffies(div_u64(wait, NSEC_PER_USEC)), 1);
+}
+
+/* Only reads and writes move data, other requests are charged as an IO */
+static void pxd_qos_bio_cost(struct bio *bio, bool *write, u32 *bytes)
+{
+	*write = bio_data_dir(bio) == WRITE;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	*bytes = (bio_op(bio) == REQ_OP_READ || bio_op(bio) == REQ_OP_WRITE) ?
+		BIO_SIZE(bio) : 0;
+#else
+	*bytes = (bio->bi_rw & (REQ_DISCARD | REQ_WRITE_SAME)) ?
+		0 : BIO_SIZE(bio);
+#endif
+}
+
+bool pxd_qos_queue_bio(struct pxd_qos *qos, struct bio *bio)
+{
+	unsigned long flags;
+	bool write;
+	u32 bytes;
+	u64 wait;
+
+	if (!pxd_qos_enabled(qos))
+		return false;
+
+	pxd_qos_bio_cost(bio, &write, &bytes);
+
+	spin_lock_irqsave(&qos->lock, flags);
+	/* stay behind the bios already held back */
+	if (bio_list_empty(&qos->bios)) {
+		wait = __pxd_qos_charge(qos, write, bytes);
+		if (!wait) {
+			spin_unlock_irqrestore(&qos->lock, flags);
+			return false;
+		}
+		schedule_delayed_work(&qos->work, pxd_qos_jiffies(wait));
+	}
+	bio_list_add(&qos->bios, bio);
+	spin_unlock_irqrestore(&qos->lock, flags);
+
+	return true;
+}
+
+static void pxd_qos_work_fn(struct work_struct *work)
+{
+	struct pxd_qos *qos = container_of(to_delayed_work(work),
+		struct pxd_qos, work);
+	struct bio_list bios;
+	struct bio *bio;
+	bool write;
+	u32 bytes;
+	u64 wait;
+
+	bio_list_init(&bios);
+
+	spin_lock_irq(&qos->lock);
+	while ((bio = bio_list_peek(&qos->bios)) != NULL) {
+		pxd_qos_bio_cost(bio, &write, &bytes);
+		wait = __pxd_qos_charge(qos, write, bytes);
+		if (wait) {
+			schedule_delayed_work(&qos->work, pxd_qos_jiffies(wait));
+			break;
+		}
+		bio_list_add(&bios, bio_list_pop(&qos->bios));
+	}
+	spin_unlock_irq(&qos->lock);
+
+	while ((bio = bio_list_pop(&bios)) != NULL)
+		qos->dispatch(qos, bio);
+}
+
+void pxd_qos_init(struct pxd_qos *qos,
+		void (*dispatch)(struct pxd_qos *qos, struct bio *bio))
+{
+	memset(qos, 0, sizeof(*qos));
+	spin_lock_init(&qos->lock);
+	bio_list_init(&qos->bios);
+	INIT_DELAYED_WORK(&qos->work, pxd_qos_work_fn);
+	qos->dispatch = dispatch;
+}
+
+void pxd_qos_destroy(struct pxd_qos *qos)
+{
+	struct bio_list bios;
+	struct bio *bio;
+	int i;
+
+	spin_lock_irq(&qos->lock);
+	WRITE_ONCE(qos->enabled, false);
+	for (i = 0; i < PXD_QOS_NR_LIMITS; ++i)
+		qos->buckets[i].rate = 0;
+	spin_unlock_irq(&qos->lock);
+
+	cancel_delayed_work_sync(&qos->work);
+
+	spin_lock_irq(&qos->lock);
+	bios = qos->bios;
+	bio_list_init(&qos->bios);
+	spin_unlock_irq(&qos->lock);
+
+	while ((bio = bio_list_pop(&bios)) != NULL)
+		qos->dispatch(qos, bio);
+}
+
+int pxd_qos_parse(struct pxd_qos *qos, const char *buf)
+{
+	u64 rates[PXD_QOS_NR_LIMITS];
+	struct pxd_qos_bucket *b;
+	char *str, *cur, *tok, *val;
+	bool enabled = false;
+	int i, rc = 0;
+
+	for (i = 0; i < PXD_QOS_NR_LIMITS; ++i)
+		rates[i] = READ_ONCE(qos->buckets[i].rate);
+
+	str = kstrdup(buf, GFP_KERNEL);
+	if (!str)
+		return -ENOMEM;
+
+	cur = str;
+	while ((tok = strsep(&cur, " \t\n")) != NULL) {
+		if (!*tok)
+			continue;
+		val = strchr(tok, '=');
+		if (!val) {
+			rc = -EINVAL;
+			break;
+		}
+		*val++ = '\0';
+		for (i = 0; i < PXD_QOS_NR_LIMITS; ++i) {
+			if (!strcmp(tok, pxd_qos_names[i]))
+				break;
+		}
+		if (i == PXD_QOS_NR_LIMITS || kstrtou64(val, 0, &rates[i]) ||
+		    rates[i] > PXD_QOS_MAX_RATE) {
+			rc = -EINVAL;
+			break;
+		}
+	}
+	kfree(str);
+
+	if (rc) {
+		printk(KERN_ERR "%s: invalid qos limits\n", __func__);
+		return rc;
+	}
+
+	spin_lock_irq(&qos->lock);
+	pxd_qos_refill(qos);
+	for (i = 0; i < PXD_QOS_NR_LIMITS; ++i) {
+		b = &qos->buckets[i];
+		if (b->rate != rates[i]) {
+			b->rate = rates[i];
+			b->tokens = pxd_qos_capacity(b);
+		}
+		enabled |= !!b->rate;
+	}
+	WRITE_ONCE(qos->enabled, enabled);
+	/* let held back bios see the new limits */
+	if (!bio_list_empty(&qos->bios))
+		mod_delayed_work(system_wq, &qos->work, 0);
+	spin_unlock_irq(&qos->lock);
+
+	return 0;
+}
+
+ssize_t pxd_qos_show(struct pxd_qos *qos, char *buf)
+{
+	return sprintf(buf, "riops=%llu wiops=%llu rbps=%llu wbps=%llu "
+		"throttled=%lu\n",
+		READ_ONCE(qos->buckets[PXD_QOS_READ_IOPS].rate),
+		READ_ONCE(qos->buckets[PXD_QOS_WRITE_IOPS].rate),
+		READ_ONCE(qos->buckets[PXD_QOS_READ_BPS].rate),
+		READ_ONCE(qos->buckets[PXD_QOS_WRITE_BPS].rate),
+		READ_ONCE(qos->nr_throttled));
+}
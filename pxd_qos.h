@@ -0,0 +1,81 @@
+#ifndef _PXD_QOS_H_
+#define _PXD_QOS_H_
+
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/bio.h>
+
+/** Limits of a device, each enforced by its own token bucket */
+enum pxd_qos_limit {
+	PXD_QOS_READ_IOPS,
+	PXD_QOS_WRITE_IOPS,
+	PXD_QOS_READ_BPS,
+	PXD_QOS_WRITE_BPS,
+	PXD_QOS_NR_LIMITS,
+};
+
+/** A bucket holds up to this much time worth of tokens */
+#define PXD_QOS_BURST_MS	100
+
+/**
+ * A token bucket. Tokens are kept in units of a microsecond at the rate of
+ * one token per second, so refills need no division.
+ */
+struct pxd_qos_bucket {
+	u64 rate;	/**< tokens per second, 0 if unlimited */
+	s64 tokens;	/**< available tokens in usecs, negative while in debt */
+};
+
+/**
+ * Per device IOPS and bandwidth limits. An IO is admitted while the
+ * buckets it draws from are not in debt, an admitted IO may take a bucket
+ * into debt so IOs larger than a bucket still get through.
+ */
+struct pxd_qos {
+	spinlock_t lock;
+	bool enabled;		/**< any limit set */
+	u64 last;		/**< time of the last refill, ns */
+	struct pxd_qos_bucket buckets[PXD_QOS_NR_LIMITS];
+	unsigned long nr_throttled;	/**< IOs which had to wait */
+
+	/** bios held back on bio based queues, oldest first */
+	struct bio_list bios;
+	struct delayed_work work;
+	void (*dispatch)(struct pxd_qos *qos, struct bio *bio);
+};
+
+/**
+ * Initialize @qos without limits. @dispatch submits bios released from
+ * pxd_qos_queue_bio(), NULL for request based queues.
+ */
+void pxd_qos_init(struct pxd_qos *qos,
+		void (*dispatch)(struct pxd_qos *qos, struct bio *bio));
+
+/** Release held bios regardless of the limits and remove all limits */
+void pxd_qos_destroy(struct pxd_qos *qos);
+
+/**
+ * Charge an IO of @bytes against the limits. Returns 0 if the IO may go,
+ * else the number of nanoseconds until it may be retried, the IO is then
+ * not charged.
+ */
+u64 pxd_qos_charge(struct pxd_qos *qos, bool write, u32 bytes);
+
+/**
+ * Charge a bio, holding it back if it has to wait or other bios are held
+ * already. Returns true if the bio was taken and will be passed to the
+ * dispatch function once the limits allow.
+ */
+bool pxd_qos_queue_bio(struct pxd_qos *qos, struct bio *bio);
+
+/** Set limits from "riops=N wiops=N rbps=N wbps=N", 0 removes a limit */
+int pxd_qos_parse(struct pxd_qos *qos, const char *buf);
+ssize_t pxd_qos_show(struct pxd_qos *qos, char *buf);
+
+static inline bool pxd_qos_enabled(struct pxd_qos *qos)
+{
+	return READ_ONCE(qos->enabled);
+}
+
+#endif /* _PXD_QOS_H_ */
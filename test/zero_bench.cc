@@ -0,0 +1,179 @@
+// Compares zero buffer scanners as used for pxd_detect_zero_writes.
+//
+// Build with "make zero_bench", run test/zero_bench [total MB per run].
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// the scanner used before, eight bytes at a time
+bool scan_scalar8(const char *base, size_t len)
+{
+	const uint64_t *q = (const uint64_t *)base;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint64_t); i++) {
+		if (q[i])
+			return false;
+	}
+	for (i = len - (len % sizeof(uint64_t)); i < len; i++) {
+		if (base[i])
+			return false;
+	}
+	return true;
+}
+
+// byte compare fallback, standing in for memchr_inv() on unaligned parts
+bool scan_bytes(const char *base, size_t len)
+{
+	return len == 0 || (base[0] == 0 && !memcmp(base, base + 1, len - 1));
+}
+
+// the kernel scanner, a cache line of words OR-ed per iteration
+bool scan_unrolled(const char *base, size_t len)
+{
+	const size_t line = 8 * sizeof(unsigned long);
+	size_t head = -(unsigned long)base & (sizeof(unsigned long) - 1);
+	const unsigned long *p;
+	size_t n;
+
+	head = head < len ? head : len;
+	if (head && !scan_bytes(base, head))
+		return false;
+
+	p = (const unsigned long *)(base + head);
+	len -= head;
+	for (n = len / line; n; --n, p += 8) {
+		if (p[0] | p[1] | p[2] | p[3] | p[4] | p[5] | p[6] | p[7])
+			return false;
+	}
+
+	len &= line - 1;
+	return !len || scan_bytes((const char *)p, len);
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.1")))
+bool scan_sse(const char *base, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 64 <= len; i += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(base + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(base + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i *)(base + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i *)(base + i + 48));
+		__m128i v = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (!_mm_testz_si128(v, v))
+			return false;
+	}
+	return scan_bytes(base + i, len - i);
+}
+
+__attribute__((target("avx2")))
+bool scan_avx2(const char *base, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 128 <= len; i += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(base + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(base + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(base + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(base + i + 96));
+		__m256i v = _mm256_or_si256(_mm256_or_si256(a, b),
+			_mm256_or_si256(c, d));
+		if (!_mm256_testz_si256(v, v))
+			return false;
+	}
+	return scan_bytes(base + i, len - i);
+}
+#endif
+
+struct scanner {
+	const char *name;
+	bool (*scan)(const char *base, size_t len);
+	bool supported;
+};
+
+std::vector<scanner> scanners()
+{
+	std::vector<scanner> ret = {
+		{"scalar8", scan_scalar8, true},
+		{"unrolled", scan_unrolled, true},
+	};
+#ifdef __x86_64__
+	__builtin_cpu_init();
+	ret.push_back({"sse4.1", scan_sse, !!__builtin_cpu_supports("sse4.1")});
+	ret.push_back({"avx2", scan_avx2, !!__builtin_cpu_supports("avx2")});
+#endif
+	return ret;
+}
+
+// every scanner has to find a set byte anywhere, including the tail
+bool verify(const scanner &s, char *buf, size_t len)
+{
+	size_t positions[] = {0, 1, len / 2, len - 65, len - 1};
+
+	if (!s.scan(buf, len) || !s.scan(buf + 1, len - 1))
+		return false;
+	for (size_t pos : positions) {
+		buf[pos] = 1;
+		bool found = !s.scan(buf, len);
+		buf[pos] = 0;
+		if (!found)
+			return false;
+	}
+	return true;
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+	const size_t sizes[] = {4096, 64 * 1024, 1024 * 1024};
+	size_t total = (argc > 1 ? strtoul(argv[1], NULL, 0) : 1024) << 20;
+	void *mem;
+
+	if (posix_memalign(&mem, 4096, sizes[2])) {
+		perror("posix_memalign");
+		return 1;
+	}
+	char *buf = (char *)mem;
+	memset(buf, 0, sizes[2]);
+
+	printf("%-10s %10s %12s\n", "scanner", "size", "GB/s");
+	for (const scanner &s : scanners()) {
+		if (!s.supported) {
+			printf("%-10s not supported\n", s.name);
+			continue;
+		}
+		for (size_t len : sizes) {
+			if (!verify(s, buf, len)) {
+				printf("%-10s failed verification at %zu\n", s.name, len);
+				return 1;
+			}
+
+			size_t iterations = total / len;
+			volatile bool zero = true;
+			auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < iterations; ++i)
+				zero = zero & s.scan(buf, len);
+			std::chrono::duration<double> elapsed =
+				std::chrono::steady_clock::now() - start;
+
+			printf("%-10s %10zu %12.2f\n", s.name, len,
+				(double)iterations * len / elapsed.count() / 1e9);
+		}
+	}
+
+	free(mem);
+	return 0;
+}